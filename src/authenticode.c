@@ -0,0 +1,313 @@
+/**
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "authenticode.h"
+
+#define PE32_MAGIC          0x10b
+#define PE32PLUS_MAGIC      0x20b
+#define CERT_TABLE_INDEX    4
+#define SECTION_HEADER_SIZE 40
+
+#define WIN_CERT_TYPE_PKCS_SIGNED_DATA 0x0002
+
+static uint16_t
+le16 (const uint8_t *ptr)
+{
+	return ptr[0] | ptr[1] << 8;
+}
+
+static uint32_t
+le32 (const uint8_t *ptr)
+{
+	return ptr[0] | ptr[1] << 8 | ptr[2] << 16 | (uint32_t)ptr[3] << 24;
+}
+
+static int
+cmp_section (const void *a, const void *b)
+{
+	const pe_section_t *x = a;
+	const pe_section_t *y = b;
+
+	if (x->offset != y->offset)
+		return x->offset < y->offset ? -1 : 1;
+
+	return 0;
+}
+
+/* Locate the headers, the certificate table and the sections. Returns -1
+ * with errno set to ENOEXEC if the image is malformed. */
+static int
+pe_image_parse (pe_image_t *image)
+{
+	const uint8_t *data = image->data;
+	size_t size = image->size;
+	uint32_t pe, opt, opt_size, dirs, dir_num, table;
+	uint16_t magic;
+
+	if (size < 0x40 || data[0] != 'M' || data[1] != 'Z')
+		goto invalid;
+
+	pe = le32 (data + 0x3c);
+	if (pe > size - 24 || memcmp (data + pe, "PE\0\0", 4) != 0)
+		goto invalid;
+
+	image->section_num = le16 (data + pe + 6);
+	opt_size = le16 (data + pe + 20);
+	opt = pe + 24;
+	if (opt_size > size - opt || opt_size < 2)
+		goto invalid;
+
+	magic = le16 (data + opt);
+	if (magic == PE32_MAGIC) {
+		dir_num = 92;
+		dirs = 96;
+	} else if (magic == PE32PLUS_MAGIC) {
+		dir_num = 108;
+		dirs = 112;
+	} else {
+		goto invalid;
+	}
+	if (opt_size < dirs)
+		goto invalid;
+
+	image->checksum_offset = opt + 64;
+	image->header_size = le32 (data + opt + 60);
+
+	/* The certificate table entry only exists with 5 data directories */
+	image->cert_dir_offset = 0;
+	image->cert_offset = 0;
+	image->cert_size = 0;
+	if (le32 (data + opt + dir_num) > CERT_TABLE_INDEX &&
+	    dirs + (CERT_TABLE_INDEX + 1) * 8 <= opt_size) {
+		image->cert_dir_offset = opt + dirs + CERT_TABLE_INDEX * 8;
+		image->cert_offset = le32 (data + image->cert_dir_offset);
+		image->cert_size = le32 (data + image->cert_dir_offset + 4);
+		if (image->cert_size == 0)
+			image->cert_offset = 0;
+	}
+
+	if (image->header_size > size ||
+	    image->header_size < (image->cert_dir_offset ?
+				  image->cert_dir_offset + 8 :
+				  image->checksum_offset + 4))
+		goto invalid;
+
+	if (image->cert_size &&
+	    (image->cert_offset > size ||
+	     image->cert_size > size - image->cert_offset))
+		goto invalid;
+
+	table = opt + opt_size;
+	if (image->section_num > (size - table) / SECTION_HEADER_SIZE)
+		goto invalid;
+
+	image->sections = calloc (image->section_num + 1, sizeof(pe_section_t));
+	if (!image->sections)
+		return -1;
+
+	for (uint32_t i = 0; i < image->section_num; i++) {
+		const uint8_t *header = data + table + i * SECTION_HEADER_SIZE;
+		pe_section_t *section = &image->sections[i];
+
+		section->size = le32 (header + 16);
+		section->offset = le32 (header + 20);
+		if (section->size == 0)
+			continue;
+		if (section->offset > size ||
+		    section->size > size - section->offset)
+			goto invalid;
+	}
+	qsort (image->sections, image->section_num, sizeof(pe_section_t),
+	       cmp_section);
+
+	return 0;
+invalid:
+	errno = ENOEXEC;
+	return -1;
+}
+
+/* Map a PE/COFF image. Returns -1 with errno set on failure, ENOEXEC if
+ * the file is not a valid image. */
+int
+pe_image_open (pe_image_t *image, const char *path)
+{
+	struct stat st;
+	int fd, err;
+
+	memset (image, 0, sizeof(pe_image_t));
+
+	fd = open (path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	if (fstat (fd, &st) < 0) {
+		err = errno;
+		close (fd);
+		errno = err;
+		return -1;
+	}
+
+	if (!S_ISREG(st.st_mode) || st.st_size == 0 ||
+	    (uint64_t)st.st_size > UINT32_MAX) {
+		close (fd);
+		errno = ENOEXEC;
+		return -1;
+	}
+
+	image->size = st.st_size;
+	image->data = mmap (NULL, image->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	err = errno;
+	close (fd);
+	if (image->data == MAP_FAILED) {
+		image->data = NULL;
+		errno = err;
+		return -1;
+	}
+
+	/* The digest reads the image once from start to end */
+	madvise (image->data, image->size, MADV_SEQUENTIAL);
+
+	if (pe_image_parse (image) < 0) {
+		err = errno;
+		pe_image_close (image);
+		errno = err;
+		return -1;
+	}
+
+	return 0;
+}
+
+void
+pe_image_close (pe_image_t *image)
+{
+	if (image->data)
+		munmap (image->data, image->size);
+	free (image->sections);
+	memset (image, 0, sizeof(pe_image_t));
+}
+
+/* Compute the Authenticode digest of the image: the headers without the
+ * checksum and the certificate table entry, the sections in the order of
+ * their offset, then whatever follows them except the certificate table.
+ * Returns -1 on failure. */
+int
+pe_image_digest (const pe_image_t *image, const EVP_MD *md, uint8_t *digest,
+		 unsigned int *digest_size)
+{
+	EVP_MD_CTX *ctx;
+	const uint8_t *data = image->data;
+	uint32_t skip_end;
+	size_t hashed;
+	int ret = -1;
+
+	ctx = EVP_MD_CTX_new ();
+	if (!ctx)
+		return -1;
+
+	if (!EVP_DigestInit_ex (ctx, md, NULL))
+		goto error;
+
+	skip_end = image->cert_dir_offset ? image->cert_dir_offset :
+					    image->header_size;
+	if (!EVP_DigestUpdate (ctx, data, image->checksum_offset) ||
+	    !EVP_DigestUpdate (ctx, data + image->checksum_offset + 4,
+			       skip_end - image->checksum_offset - 4))
+		goto error;
+	if (image->cert_dir_offset &&
+	    !EVP_DigestUpdate (ctx, data + image->cert_dir_offset + 8,
+			       image->header_size - image->cert_dir_offset - 8))
+		goto error;
+
+	hashed = image->header_size;
+	for (uint32_t i = 0; i < image->section_num; i++) {
+		const pe_section_t *section = &image->sections[i];
+
+		if (section->size == 0)
+			continue;
+		if (!EVP_DigestUpdate (ctx, data + section->offset,
+				       section->size))
+			goto error;
+		hashed += section->size;
+	}
+
+	if (image->size > hashed + image->cert_size &&
+	    !EVP_DigestUpdate (ctx, data + hashed,
+			       image->size - hashed - image->cert_size))
+		goto error;
+
+	if (!EVP_DigestFinal_ex (ctx, digest, digest_size))
+		goto error;
+
+	ret = 0;
+error:
+	EVP_MD_CTX_free (ctx);
+
+	return ret;
+}
+
+/* Walk the PKCS#7 signatures in the certificate table. "pos" has to start
+ * at 0. Returns 1 with the DER of the next signature, or 0 at the end. */
+int
+pe_image_next_signature (const pe_image_t *image, uint32_t *pos,
+			 const uint8_t **sig, uint32_t *sig_size)
+{
+	const uint8_t *table = image->data + image->cert_offset;
+	uint32_t start, length;
+	uint64_t next;
+
+	while (*pos < image->cert_size && image->cert_size - *pos >= 8) {
+		start = *pos;
+		length = le32 (table + start);
+		if (length < 8 || length > image->cert_size - start)
+			break;
+
+		/* The entries are aligned to 8 bytes */
+		next = ((uint64_t)start + length + 7) & ~(uint64_t)7;
+		*pos = next < image->cert_size ? next : image->cert_size;
+
+		if (le16 (table + start + 6) == WIN_CERT_TYPE_PKCS_SIGNED_DATA) {
+			*sig = table + start + 8;
+			*sig_size = length - 8;
+			return 1;
+		}
+	}
+
+	*pos = image->cert_size;
+
+	return 0;
+}
@@ -0,0 +1,64 @@
+/**
+ * Copyright (C) 2026 agent <agent@local>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * In addition, as a special exception, the copyright holders give
+ * permission to link the code of portions of this program with the
+ * OpenSSL library under certain conditions as described in each
+ * individual source file, and distribute linked combinations
+ * including the two.
+ *
+ * You must obey the GNU General Public License in all respects
+ * for all of the code used other than OpenSSL.  If you modify
+ * file(s) with this exception, you may extend this exception to your
+ * version of the file(s), but you are not obligated to do so.  If you
+ * do not wish to do so, delete this exception statement from your
+ * version.  If you delete this exception statement from all source
+ * files in the program, then also delete it here.
+ */
+#ifndef __AUTHENTICODE_H__
+#define __AUTHENTICODE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <openssl/evp.h>
+
+typedef struct {
+	uint32_t offset;
+	uint32_t size;
+} pe_section_t;
+
+/* A PE/COFF image mapped from a file, with the parts the Authenticode
+ * digest skips or needs located */
+typedef struct {
+	uint8_t      *data;
+	size_t        size;
+	uint32_t      checksum_offset;
+	uint32_t      cert_dir_offset;	/* 0 if there is no certificate table entry */
+	uint32_t      header_size;
+	uint32_t      cert_offset;	/* the certificate table, 0 if unsigned */
+	uint32_t      cert_size;
+	uint32_t      section_num;
+	pe_section_t *sections;		/* sorted by their offset in the file */
+} pe_image_t;
+
+int pe_image_open (pe_image_t *image, const char *path);
+void pe_image_close (pe_image_t *image);
+int pe_image_digest (const pe_image_t *image, const EVP_MD *md,
+		     uint8_t *digest, unsigned int *digest_size);
+int pe_image_next_signature (const pe_image_t *image, uint32_t *pos,
+			     const uint8_t **sig, uint32_t *sig_size);
+
+#endif /* __AUTHENTICODE_H__ */
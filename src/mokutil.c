@@ -29,30 +29,45 @@
  * version.  If you delete this exception statement from all source
  * files in the program, then also delete it here.
  */
+#define _GNU_SOURCE	/* pipe2() */
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <fnmatch.h>
 #include <unistd.h>
 #include <termios.h>
 #include <getopt.h>
 #include <shadow.h>
 #include <sys/time.h>
-
+#include <time.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+#include <openssl/bn.h>
+#include <openssl/cms.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/pkcs7.h>
 #include <openssl/sha.h>
 #include <openssl/x509.h>
+#include <openssl/x509v3.h>
 
 #include <crypt.h>
 #include <efivar.h>
 
 #include "signature.h"
 #include "password-crypt.h"
+#include "authenticode.h"
 
 #define PASSWORD_MAX 256
 #define PASSWORD_MIN 1
@@ -84,18 +99,55 @@
 #define DELETE_HASH        (1 << 22)
 #define VERBOSITY          (1 << 23)
 #define TIMEOUT            (1 << 24)
+#define BENCH_FIRMWARE     (1 << 25)
+#define METRICS            (1 << 26)
+#define SUMMARY            (1 << 27)
+#define POSTURE            (1 << 28)
+#define EXPORT_ESL         (1 << 29)
+#define EXPORT_DIR         (1 << 30)
+#define AUDIT              (1ULL << 31)
+#define SCAN_BOOT          (1ULL << 32)
+#define VERIFY_IMAGE       (1ULL << 33)
+#define SCAN_MODULES       (1ULL << 34)
+#define EXPIRING           (1ULL << 35)
 
 #define DEFAULT_CRYPT_METHOD SHA512_BASED
 #define DEFAULT_SALT_SIZE    SHA512_SALT_MAX
 #define SETTINGS_LEN         (DEFAULT_SALT_SIZE*2)
 #define BUF_SIZE             300
 
+#define OUTBUF_SIZE          65536
+#define MAX_WORKERS          64
+#define WORKER_WINDOW        4
+
+#define BENCH_READ_ITERATIONS 100
+#define BENCH_WRITE_CYCLES    10
+#define BENCH_VAR_NAME        "MokBench"
+
 typedef unsigned long efi_status_t;
 typedef uint8_t  efi_bool_t;
 typedef wchar_t efi_char16_t;		/* UNICODE character */
 
 static int use_simple_hash;
 
+typedef enum {
+	ARCHIVE_NONE = 0,
+	ARCHIVE_TAR,
+	ARCHIVE_CPIO,
+} ArchiveFormat;
+
+typedef enum {
+	OUTPUT_TEXT = 0,
+	OUTPUT_SHORT,
+	OUTPUT_JSON,
+} OutputFormat;
+
+static OutputFormat output_format;
+
+/* The keys to list, counting from 1 */
+static uint32_t key_index_first;
+static uint32_t key_index_last;
+
 typedef enum {
 	DELETE_MOK = 0,
 	ENROLL_MOK,
@@ -130,6 +182,36 @@ const char *db_friendly_name[] = {
 	[DBX]           = "DBX",
 };
 
+const efi_guid_t *db_var_guid[] = {
+	[MOK_LIST_RT]   = &efi_guid_shim,
+	[MOK_LIST_X_RT] = &efi_guid_shim,
+	[PK]            = &efi_guid_global,
+	[KEK]           = &efi_guid_global,
+	[DB]            = &efi_guid_security,
+	[DBX]           = &efi_guid_security,
+};
+
+#define DB_NUM (sizeof(db_var_name)/sizeof(db_var_name[0]))
+
+typedef struct {
+	const efi_guid_t *guid;
+	const char       *name;
+} SignatureType;
+
+static const SignatureType sig_types[] = {
+	{&efi_guid_x509_cert,   "x509"},
+	{&efi_guid_sha1,        "sha1"},
+	{&efi_guid_sha224,      "sha224"},
+	{&efi_guid_sha256,      "sha256"},
+	{&efi_guid_sha384,      "sha384"},
+	{&efi_guid_sha512,      "sha512"},
+	{&efi_guid_x509_sha256, "x509_sha256"},
+	{&efi_guid_x509_sha384, "x509_sha384"},
+	{&efi_guid_x509_sha512, "x509_sha512"},
+};
+
+#define SIG_TYPE_NUM (sizeof(sig_types)/sizeof(sig_types[0]))
+
 typedef struct {
 	EFI_SIGNATURE_LIST *header;
 	uint32_t            mok_size;
@@ -153,8 +235,8 @@ print_help ()
 	printf ("  --list-enrolled\t\t\tList the enrolled keys\n");
 	printf ("  --list-new\t\t\t\tList the keys to be enrolled\n");
 	printf ("  --list-delete\t\t\t\tList the keys to be deleted\n");
-	printf ("  --import <der file...>\t\tImport keys\n");
-	printf ("  --delete <der file...>\t\tDelete specific keys\n");
+	printf ("  --import <key file...>\t\tImport keys\n");
+	printf ("  --delete <key file...>\t\tDelete specific keys\n");
 	printf ("  --revoke-import\t\t\tRevoke the import request\n");
 	printf ("  --revoke-delete\t\t\tRevoke the delete request\n");
 	printf ("  --export\t\t\t\tExport keys to files\n");
@@ -163,7 +245,7 @@ print_help ()
 	printf ("  --disable-validation\t\t\tDisable signature validation\n");
 	printf ("  --enable-validation\t\t\tEnable signature validation\n");
 	printf ("  --sb-state\t\t\t\tShow SecureBoot State\n");
-	printf ("  --test-key <der file>\t\t\tTest if the key is enrolled or not\n");
+	printf ("  --test-key <key file|dir|hash...>\tTest if the keys are enrolled or not\n");
 	printf ("  --reset\t\t\t\tReset MOK list\n");
 	printf ("  --generate-hash[=password]\t\tGenerate the password hash\n");
 	printf ("  --ignore-db\t\t\t\tIgnore DB for validation\n");
@@ -176,12 +258,36 @@ print_help ()
 	printf ("  --db\t\t\t\t\tList the keys in db\n");
 	printf ("  --dbx\t\t\t\t\tList the keys in dbx\n");
 	printf ("  --timeout <-1,0..0x7fff>\t\tSet the timeout for MOK prompt\n");
+	printf ("  --bench-firmware[=iterations]\t\tMeasure the latency of firmware variables\n");
+	printf ("  --metrics <file>\t\t\tWrite Prometheus metrics to a file\n");
+	printf ("  --summary\t\t\t\tSummarize the size and entries of every database\n");
+	printf ("  --posture\t\t\t\tReport the Secure Boot state, pending requests and keys\n");
+	printf ("  --audit\t\t\t\tCheck the enrolled keys against dbx and MokListX\n");
+	printf ("  --expiring <days>\t\t\tList the keys expiring within the given days\n");
+	printf ("  --scan-boot <directory>\t\tCheck the EFI binaries against dbx and MokListX\n");
+	printf ("  --verify-image <EFI binary...>\tTell whether shim would trust the binaries\n");
+	printf ("  --scan-modules <directory>\t\tCheck the signers of the kernel modules\n");
+	printf ("  --export-esl <var> [file]\t\tWrite the raw signature lists of a variable\n");
+	printf ("  --export-dir <directory>\t\tExport keys named by their SHA-256\n");
+	printf ("  --import-dir <directory>\t\tImport the keys found in a directory\n");
+	printf ("  --import-esl <esl/auth file>\t\tImport the entries of signature lists\n");
+	printf ("  --import-hashes <file>\t\tImport the hashes listed in a file\n");
+	printf ("  --delete-hashes <file>\t\tDelete the hashes listed in a file\n");
+	printf ("  --import-binary <EFI binary...>\tEnroll the Authenticode hash of binaries\n");
+	printf ("  --blacklist-binary <EFI binary...>\tBlacklist the Authenticode hash of binaries\n");
 	printf ("\n");
 	printf ("Supplimentary Options:\n");
 	printf ("  --hash-file <hash file>\t\tUse the specific password hash\n");
 	printf ("  --root-pw\t\t\t\tUse the root password\n");
 	printf ("  --simple-hash\t\t\t\tUse the old password hash method\n");
 	printf ("  --mokx\t\t\t\tManipulate the MOK blacklist\n");
+	printf ("  --bench-write\t\t\t\tAlso benchmark writing a scratch variable\n");
+	printf ("  --output <text/json>\t\t\tOutput format of the list and state commands\n");
+	printf ("  --short\t\t\t\tOnly list the fingerprint and CN of the keys\n");
+	printf ("  --index <N>\t\t\t\tOnly list the N-th key\n");
+	printf ("  --range <A-B>\t\t\t\tOnly list the keys from A to B\n");
+	printf ("  --format <tar/cpio>\t\t\tWrite the exported keys to stdout as an archive\n");
+	printf ("  --glob <pattern>\t\t\tOnly import the files matching the pattern\n");
 }
 
 static int
@@ -208,6 +314,46 @@ test_and_delete_var (const char *var_name)
 	return ret;
 }
 
+typedef struct {
+	const efi_guid_t *guid;
+	const char       *name;
+	uint8_t          *data;
+	size_t            size;
+	int               err;
+} EfiVarEntry;
+
+/* Read a set of variables into a snapshot, "err" is set to the errno of
+ * a failed read (ENOENT if the variable doesn't exist). libefivar records
+ * its errors in process-wide state, so the reads are done one by one. */
+static void
+read_var_entries (EfiVarEntry *entries, unsigned int n)
+{
+	uint32_t attributes;
+
+	for (unsigned int i = 0; i < n; i++) {
+		entries[i].data = NULL;
+		entries[i].size = 0;
+		entries[i].err = 0;
+
+		if (efi_get_variable (*entries[i].guid, entries[i].name,
+				      &entries[i].data, &entries[i].size,
+				      &attributes) < 0) {
+			entries[i].err = errno ? errno : EIO;
+			entries[i].data = NULL;
+			entries[i].size = 0;
+		}
+	}
+}
+
+static void
+free_var_entries (EfiVarEntry *entries, unsigned int n)
+{
+	for (unsigned int i = 0; i < n; i++) {
+		free (entries[i].data);
+		entries[i].data = NULL;
+	}
+}
+
 static unsigned long
 efichar_from_char (efi_char16_t *dest, const char *src, size_t dest_len)
 {
@@ -343,51 +489,586 @@ build_mok_list (void *data, unsigned long data_size, uint32_t *mok_num)
 	return list;
 }
 
+/* Return the index of the signature type in sig_types[] or -1 */
+static int
+signature_type_index (const efi_guid_t *type)
+{
+	for (unsigned int i = 0; i < SIG_TYPE_NUM; i++) {
+		if (efi_guid_cmp (type, sig_types[i].guid) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+/* Walk to the next signature list in a variable. Pass NULL as "prev" to
+ * get the first one. Returns NULL at the end of the data or if the next
+ * list is corrupted, in which case "corrupted" is set. */
+static EFI_SIGNATURE_LIST *
+next_signature_list (void *data, size_t data_size, EFI_SIGNATURE_LIST *prev,
+		     int *corrupted)
+{
+	EFI_SIGNATURE_LIST *CertList;
+	size_t offset = 0;
+
+	*corrupted = 0;
+
+	if (prev)
+		offset = (uint8_t *)prev - (uint8_t *)data +
+			 prev->SignatureListSize;
+
+	if (offset >= data_size)
+		return NULL;
+
+	CertList = (EFI_SIGNATURE_LIST *)((uint8_t *)data + offset);
+	if (data_size - offset < sizeof(EFI_SIGNATURE_LIST) ||
+	    CertList->SignatureListSize > data_size - offset ||
+	    CertList->SignatureSize <= sizeof(efi_guid_t) ||
+	    CertList->SignatureListSize < sizeof(EFI_SIGNATURE_LIST) +
+					  CertList->SignatureHeaderSize +
+					  CertList->SignatureSize) {
+		*corrupted = 1;
+		return NULL;
+	}
+
+	return CertList;
+}
+
+/* The number of signatures carried in the signature list */
+static uint32_t
+signature_count (const EFI_SIGNATURE_LIST *CertList)
+{
+	return (CertList->SignatureListSize - sizeof(EFI_SIGNATURE_LIST) -
+		CertList->SignatureHeaderSize) / CertList->SignatureSize;
+}
+
+/* The n-th signature in the signature list */
+static EFI_SIGNATURE_DATA *
+signature_at (EFI_SIGNATURE_LIST *CertList, uint32_t n)
+{
+	return (EFI_SIGNATURE_DATA *)((uint8_t *)CertList +
+		sizeof(EFI_SIGNATURE_LIST) + CertList->SignatureHeaderSize +
+		n * CertList->SignatureSize);
+}
+
+typedef struct {
+	int      present;
+	size_t   size;
+	uint64_t count[SIG_TYPE_NUM];
+	uint64_t unknown;
+	uint32_t largest;
+	int      corrupted;
+} DBStats;
+
+/* Count the signatures by type from the list headers alone */
+static void
+count_signatures (void *data, size_t data_size, DBStats *stats)
+{
+	EFI_SIGNATURE_LIST *CertList = NULL;
+	uint32_t sig_num, sig_data_size;
+	int type;
+
+	memset (stats, 0, sizeof(DBStats));
+	stats->present = 1;
+	stats->size = data_size;
+
+	while ((CertList = next_signature_list (data, data_size, CertList,
+						&stats->corrupted))) {
+		sig_num = signature_count (CertList);
+		sig_data_size = CertList->SignatureSize - sizeof(efi_guid_t);
+		type = signature_type_index (&CertList->SignatureType);
+
+		if (type < 0)
+			stats->unknown += sig_num;
+		else
+			stats->count[type] += sig_num;
+
+		if (sig_data_size > stats->largest)
+			stats->largest = sig_data_size;
+	}
+}
+
+typedef void (*parallel_fn) (void *ctx, unsigned int index);
+
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t  cond;
+	unsigned int    items;
+	unsigned int    next;
+	unsigned int    emitted;
+	unsigned int    window;
+	uint8_t        *done;
+	parallel_fn     work;
+	void           *ctx;
+} WorkQueue;
+
+/* The number of threads worth starting for the given number of items */
+static unsigned int
+worker_count (unsigned int items)
+{
+	long cpus = sysconf (_SC_NPROCESSORS_ONLN);
+
+	if (cpus < 1)
+		cpus = 1;
+	if (cpus > MAX_WORKERS)
+		cpus = MAX_WORKERS;
+	if ((unsigned long)cpus > items)
+		cpus = items;
+
+	return cpus;
+}
+
+static void *
+queue_worker (void *arg)
+{
+	WorkQueue *q = arg;
+	unsigned int index;
+
+	pthread_mutex_lock (&q->lock);
+	while (1) {
+		/* Don't run too far ahead of the ordered consumer */
+		while (q->next < q->items && q->window &&
+		       q->next >= q->emitted + q->window)
+			pthread_cond_wait (&q->cond, &q->lock);
+
+		if (q->next >= q->items)
+			break;
+
+		index = q->next++;
+		pthread_mutex_unlock (&q->lock);
+
+		q->work (q->ctx, index);
+
+		pthread_mutex_lock (&q->lock);
+		q->done[index] = 1;
+		pthread_cond_broadcast (&q->cond);
+	}
+	pthread_mutex_unlock (&q->lock);
+
+	return NULL;
+}
+
+/* Call work() for every item on a pool of threads sized to the CPUs. If
+ * emit() is given, it's called from the calling thread for every item in
+ * the original order as soon as that item is done. */
+static void
+run_parallel (unsigned int items, parallel_fn work, parallel_fn emit,
+	      void *ctx)
+{
+	WorkQueue q;
+	pthread_t *threads = NULL;
+	unsigned int n_threads, started = 0;
+
+	n_threads = worker_count (items);
+	if (n_threads > 1) {
+		threads = malloc (n_threads * sizeof(pthread_t));
+		q.done = calloc (items, sizeof(uint8_t));
+	}
+
+	if (threads && q.done) {
+		pthread_mutex_init (&q.lock, NULL);
+		pthread_cond_init (&q.cond, NULL);
+		q.items = items;
+		q.next = 0;
+		q.emitted = 0;
+		q.window = emit ? n_threads * WORKER_WINDOW : 0;
+		q.work = work;
+		q.ctx = ctx;
+
+		for (unsigned int t = 0; t < n_threads; t++) {
+			if (pthread_create (&threads[started], NULL,
+					    queue_worker, &q) == 0)
+				started++;
+		}
+	}
+
+	if (started == 0) {
+		/* No threads, do everything here */
+		for (unsigned int i = 0; i < items; i++) {
+			work (ctx, i);
+			if (emit)
+				emit (ctx, i);
+		}
+	} else {
+		if (emit) {
+			pthread_mutex_lock (&q.lock);
+			for (unsigned int i = 0; i < items; i++) {
+				while (!q.done[i])
+					pthread_cond_wait (&q.cond, &q.lock);
+				pthread_mutex_unlock (&q.lock);
+
+				emit (ctx, i);
+
+				pthread_mutex_lock (&q.lock);
+				q.emitted++;
+				pthread_cond_broadcast (&q.cond);
+			}
+			pthread_mutex_unlock (&q.lock);
+		}
+
+		for (unsigned int t = 0; t < started; t++)
+			pthread_join (threads[t], NULL);
+	}
+
+	if (threads && q.done) {
+		pthread_cond_destroy (&q.cond);
+		pthread_mutex_destroy (&q.lock);
+	}
+	if (n_threads > 1) {
+		free (threads);
+		free (q.done);
+	}
+}
+
+static const char hex_digits[] = "0123456789abcdef";
+
+/* Hex-encode "size" bytes into "dst", putting "sep" between the bytes if
+ * it isn't '\0'. Returns the number of characters written. */
+static size_t
+hex_encode (char *dst, const uint8_t *src, size_t size, char sep)
+{
+	char *ptr = dst;
+
+	for (size_t i = 0; i < size; i++) {
+		if (sep && i > 0)
+			*ptr++ = sep;
+		*ptr++ = hex_digits[src[i] >> 4];
+		*ptr++ = hex_digits[src[i] & 0x0f];
+	}
+
+	return ptr - dst;
+}
+
+/* Output buffer to batch many small pieces into large writes */
+typedef struct {
+	FILE   *fp;
+	size_t  len;
+	char    data[OUTBUF_SIZE];
+} OutBuf;
+
+static void
+outbuf_flush (OutBuf *ob)
+{
+	if (ob->len > 0)
+		fwrite (ob->data, 1, ob->len, ob->fp);
+	ob->len = 0;
+}
+
+/* Make sure "size" bytes fit in the buffer. "size" must not exceed
+ * OUTBUF_SIZE. */
+static char *
+outbuf_reserve (OutBuf *ob, size_t size)
+{
+	if (ob->len + size > OUTBUF_SIZE)
+		outbuf_flush (ob);
+
+	return ob->data + ob->len;
+}
+
+static void
+outbuf_put (OutBuf *ob, const char *str, size_t size)
+{
+	memcpy (outbuf_reserve (ob, size), str, size);
+	ob->len += size;
+}
+
+/* Like outbuf_put(), but "size" may exceed OUTBUF_SIZE */
+static void
+outbuf_write (OutBuf *ob, const void *data, size_t size)
+{
+	if (size <= OUTBUF_SIZE) {
+		outbuf_put (ob, data, size);
+		return;
+	}
+
+	outbuf_flush (ob);
+	fwrite (data, 1, size, ob->fp);
+}
+
+static void
+outbuf_hex (OutBuf *ob, const uint8_t *data, size_t size)
+{
+	ob->len += hex_encode (outbuf_reserve (ob, size * 2), data, size, '\0');
+}
+
 static int
-print_x509 (char *cert, int cert_size)
+print_x509 (FILE *fp, char *cert, int cert_size)
 {
+	const unsigned char *der = (const unsigned char *)cert;
 	X509 *X509cert;
-	BIO *cert_bio;
-	SHA_CTX ctx;
 	uint8_t fingerprint[SHA_DIGEST_LENGTH];
+	char hex[SHA_DIGEST_LENGTH * 3];
+	size_t hex_len;
 
-	cert_bio = BIO_new (BIO_s_mem ());
-	BIO_write (cert_bio, cert, cert_size);
-	if (cert_bio == NULL) {
-		fprintf (stderr, "Failed to write BIO\n");
+	X509cert = d2i_X509 (NULL, &der, cert_size);
+	if (X509cert == NULL) {
+		fprintf (stderr, "Invalid X509 certificate\n");
 		return -1;
 	}
 
-	X509cert = d2i_X509_bio (cert_bio, NULL);
-	if (X509cert == NULL) {
-		fprintf (stderr, "Invalid X509 certificate\n");
+	EVP_Digest (cert, cert_size, fingerprint, NULL, EVP_sha1 (), NULL);
+	hex_len = hex_encode (hex, fingerprint, SHA_DIGEST_LENGTH, ':');
+
+	fprintf (fp, "SHA1 Fingerprint: %.*s\n", (int)hex_len, hex);
+	X509_print_fp (fp, X509cert);
+
+	X509_free (X509cert);
+
+	return 0;
+}
+
+typedef enum {
+	TBS_CERTIFICATE = -1,
+	TBS_SERIAL = 0,
+	TBS_SIGNATURE,
+	TBS_ISSUER,
+	TBS_VALIDITY,
+	TBS_SUBJECT,
+} TbsField;
+
+/* Parse the identifier and length octets of a DER element. Returns the
+ * size of the header or -1 if the element doesn't fit in "avail". */
+static int
+der_read_header (const uint8_t *der, size_t avail, uint8_t *tag, size_t *len)
+{
+	size_t hdr_len = 2;
+	size_t value_len;
+
+	if (avail < 2 || (der[0] & 0x1f) == 0x1f)
 		return -1;
+
+	*tag = der[0];
+	value_len = der[1];
+	if (value_len & 0x80) {
+		unsigned int num = value_len & 0x7f;
+
+		if (num == 0 || num > 4 || avail < 2 + num)
+			return -1;
+
+		value_len = 0;
+		for (unsigned int i = 0; i < num; i++)
+			value_len = (value_len << 8) | der[2 + i];
+		hdr_len += num;
 	}
 
-	SHA1_Init (&ctx);
-	SHA1_Update (&ctx, cert, cert_size);
-	SHA1_Final (fingerprint, &ctx);
+	if (value_len > avail - hdr_len)
+		return -1;
+
+	*len = value_len;
+
+	return hdr_len;
+}
+
+/* Locate a field of the TBSCertificate, or the TBSCertificate itself,
+ * without decoding the certificate. On success "field" points to the
+ * whole DER element (tag included). */
+static int
+der_tbs_field (const uint8_t *cert, size_t cert_size, TbsField which,
+	       const uint8_t **field, size_t *field_size)
+{
+	const uint8_t *ptr;
+	size_t avail, len;
+	uint8_t tag;
+	int hdr;
+
+	/* Certificate ::= SEQUENCE { tbsCertificate, ... } */
+	hdr = der_read_header (cert, cert_size, &tag, &len);
+	if (hdr < 0 || tag != 0x30)
+		return -1;
+	ptr = cert + hdr;
+	avail = len;
 
-	printf ("SHA1 Fingerprint: ");
-	for (unsigned int i = 0; i < SHA_DIGEST_LENGTH; i++) {
-		printf ("%02x", fingerprint[i]);
-		if (i < SHA_DIGEST_LENGTH - 1)
-			printf (":");
+	/* TBSCertificate ::= SEQUENCE { ... } */
+	hdr = der_read_header (ptr, avail, &tag, &len);
+	if (hdr < 0 || tag != 0x30)
+		return -1;
+	if (which == TBS_CERTIFICATE) {
+		*field = ptr;
+		*field_size = hdr + len;
+		return 0;
 	}
-	printf ("\n");
-	X509_print_fp (stdout, X509cert);
+	ptr += hdr;
+	avail = len;
 
-	BIO_free (cert_bio);
+	/* skip the optional [0] EXPLICIT version */
+	hdr = der_read_header (ptr, avail, &tag, &len);
+	if (hdr < 0)
+		return -1;
+	if (tag == 0xa0) {
+		ptr += hdr + len;
+		avail -= hdr + len;
+	}
+
+	for (int i = 0; i <= (int)which; i++) {
+		hdr = der_read_header (ptr, avail, &tag, &len);
+		if (hdr < 0)
+			return -1;
+		if (i == which) {
+			*field = ptr;
+			*field_size = hdr + len;
+			return 0;
+		}
+		ptr += hdr + len;
+		avail -= hdr + len;
+	}
+
+	return -1;
+}
+
+/* Parse "num" decimal digits, or return -1 */
+static int
+der_digits (const uint8_t *ptr, unsigned int num)
+{
+	int value = 0;
+
+	for (unsigned int i = 0; i < num; i++) {
+		if (!isdigit (ptr[i]))
+			return -1;
+		value = value * 10 + ptr[i] - '0';
+	}
+
+	return value;
+}
+
+/* Decode a UTCTime or GeneralizedTime in the DER form RFC 5280 asks for,
+ * YYMMDDHHMMSSZ or YYYYMMDDHHMMSSZ */
+static int
+der_time_to_epoch (uint8_t tag, const uint8_t *value, size_t len,
+		   time_t *epoch)
+{
+	unsigned int year_len;
+	struct tm tm;
+	int year;
+
+	if (tag == 0x17 && len == 13)
+		year_len = 2;
+	else if (tag == 0x18 && len == 15)
+		year_len = 4;
+	else
+		return -1;
+
+	if (value[len - 1] != 'Z')
+		return -1;
+
+	memset (&tm, 0, sizeof(tm));
+	year = der_digits (value, year_len);
+	tm.tm_mon = der_digits (value + year_len, 2) - 1;
+	tm.tm_mday = der_digits (value + year_len + 2, 2);
+	tm.tm_hour = der_digits (value + year_len + 4, 2);
+	tm.tm_min = der_digits (value + year_len + 6, 2);
+	tm.tm_sec = der_digits (value + year_len + 8, 2);
+	if (year < 0 || tm.tm_mon < 0 || tm.tm_mon > 11 || tm.tm_mday < 1 ||
+	    tm.tm_mday > 31 || tm.tm_hour < 0 || tm.tm_hour > 23 ||
+	    tm.tm_min < 0 || tm.tm_min > 59 || tm.tm_sec < 0 || tm.tm_sec > 60)
+		return -1;
+
+	/* UTCTime years from 50 to 99 are 19xx */
+	if (year_len == 2)
+		year += year < 50 ? 2000 : 1900;
+	tm.tm_year = year - 1900;
+
+	*epoch = timegm (&tm);
+
+	return 0;
+}
+
+/* Read the validity period of the certificate without decoding the rest
+ * of it */
+static int
+der_cert_validity (const uint8_t *cert, size_t cert_size, time_t *not_before,
+		   time_t *not_after)
+{
+	const uint8_t *field;
+	size_t field_size, len;
+	uint8_t tag;
+	int hdr;
+
+	if (der_tbs_field (cert, cert_size, TBS_VALIDITY, &field,
+			   &field_size) < 0)
+		return -1;
+
+	/* Validity ::= SEQUENCE { notBefore Time, notAfter Time } */
+	hdr = der_read_header (field, field_size, &tag, &len);
+	if (hdr < 0 || tag != 0x30)
+		return -1;
+	field += hdr;
+	field_size = len;
+
+	for (int i = 0; i < 2; i++) {
+		hdr = der_read_header (field, field_size, &tag, &len);
+		if (hdr < 0 ||
+		    der_time_to_epoch (tag, field + hdr, len,
+				       i == 0 ? not_before : not_after) < 0)
+			return -1;
+		field += hdr + len;
+		field_size -= hdr + len;
+	}
 
 	return 0;
 }
 
+/* Decode only the subject of the certificate and return its common name */
+static char *
+get_subject_cn (const uint8_t *cert, size_t cert_size)
+{
+	const uint8_t *field;
+	size_t field_size;
+	X509_NAME *name;
+	X509_NAME_ENTRY *entry;
+	unsigned char *utf8 = NULL;
+	char *cn = NULL;
+	int index;
+
+	if (der_tbs_field (cert, cert_size, TBS_SUBJECT, &field, &field_size) < 0)
+		return NULL;
+
+	name = d2i_X509_NAME (NULL, &field, field_size);
+	if (!name)
+		return NULL;
+
+	index = X509_NAME_get_index_by_NID (name, NID_commonName, -1);
+	if (index >= 0) {
+		entry = X509_NAME_get_entry (name, index);
+		if (ASN1_STRING_to_UTF8 (&utf8, X509_NAME_ENTRY_get_data (entry)) >= 0) {
+			cn = strdup ((char *)utf8);
+			OPENSSL_free (utf8);
+		}
+	} else {
+		cn = X509_NAME_oneline (name, NULL, 0);
+	}
+
+	X509_NAME_free (name);
+
+	return cn;
+}
+
 static int
-print_hash_array (efi_guid_t *hash_type, void *hash_array, uint32_t array_size)
+print_x509_short (FILE *fp, const uint8_t *cert, uint32_t cert_size)
+{
+	uint8_t fingerprint[SHA256_DIGEST_LENGTH];
+	char hex[SHA256_DIGEST_LENGTH * 2];
+	char *cn;
+
+	/* The fingerprint covers the DER bytes, no need to decode them */
+	EVP_Digest (cert, cert_size, fingerprint, NULL, EVP_sha256 (), NULL);
+	hex_encode (hex, fingerprint, SHA256_DIGEST_LENGTH, '\0');
+
+	cn = get_subject_cn (cert, cert_size);
+	fprintf (fp, "%.*s %s\n", (int)sizeof(hex), hex,
+		 cn ? cn : "(invalid certificate)");
+	free (cn);
+
+	return cn ? 0 : -1;
+}
+
+static int
+print_hash_array (FILE *fp, efi_guid_t *hash_type, void *hash_array,
+		  uint32_t array_size)
 {
 	uint32_t hash_size, remain;
 	uint32_t sig_size;
 	uint8_t *hash;
+	OutBuf *ob;
 	char *name;
 
 	if (!hash_array || array_size == 0) {
@@ -406,74 +1087,464 @@ print_hash_array (efi_guid_t *hash_type, void *hash_array, uint32_t array_size)
 	hash_size = efi_hash_size (hash_type);
 	sig_size = hash_size + sizeof(efi_guid_t);
 
-	printf ("  [%s]\n", name);
+	fprintf (fp, "  [%s]\n", name);
 	free(name);
 	remain = array_size;
 	hash = (uint8_t *)hash_array;
 
+	ob = malloc (sizeof(OutBuf));
+	if (!ob) {
+		fprintf (stderr, "Failed to allocate buffer: %m\n");
+		return -1;
+	}
+	ob->fp = fp;
+	ob->len = 0;
+
 	while (remain > 0) {
 		if (remain < sig_size) {
+			outbuf_flush (ob);
+			free (ob);
 			fprintf (stderr, "invalid array size\n");
 			return -1;
 		}
 
-		printf ("  ");
 		hash += sizeof(efi_guid_t);
-		for (unsigned int i = 0; i<hash_size; i++)
-			printf ("%02x", *(hash + i));
-		printf ("\n");
+		outbuf_put (ob, "  ", 2);
+		outbuf_hex (ob, hash, hash_size);
+		outbuf_put (ob, "\n", 1);
 		hash += hash_size;
 		remain -= sig_size;
 	}
 
+	outbuf_flush (ob);
+	free (ob);
+
 	return 0;
 }
 
 static int
-list_keys (uint8_t *data, size_t data_size)
+asn1_time_to_epoch (const ASN1_TIME *t, time_t *epoch)
 {
-	uint32_t mok_num;
-	MokListNode *list;
+	struct tm tm;
 
-	list = build_mok_list (data, data_size, &mok_num);
-	if (list == NULL) {
+	if (!t || ASN1_TIME_to_tm (t, &tm) != 1)
 		return -1;
+
+	*epoch = timegm (&tm);
+
+	return 0;
+}
+
+/* Print a JSON string, or null if there is none */
+static void
+json_print_string (FILE *fp, const char *str)
+{
+	if (!str) {
+		fputs ("null", fp);
+		return;
 	}
 
-	for (unsigned int i = 0; i < mok_num; i++) {
-		printf ("[key %d]\n", i+1);
-		if (efi_guid_cmp (&list[i].header->SignatureType, &efi_guid_x509_cert) == 0) {
-			print_x509 ((char *)list[i].mok, list[i].mok_size);
-		} else {
-			print_hash_array (&list[i].header->SignatureType,
-					  list[i].mok, list[i].mok_size);
-		}
-		if (i < mok_num - 1)
-			printf ("\n");
+	fputc ('"', fp);
+	for (; *str; str++) {
+		unsigned char c = *str;
+
+		if (c == '"' || c == '\\')
+			fprintf (fp, "\\%c", c);
+		else if (c < 0x20)
+			fprintf (fp, "\\u%04x", c);
+		else
+			fputc (c, fp);
 	}
+	fputc ('"', fp);
+}
 
-	free (list);
+/* Print a SHA-256 digest in hex to stdout */
+static void
+print_sha256 (const uint8_t *digest)
+{
+	char hex[SHA256_DIGEST_LENGTH * 2];
 
-	return 0;
+	hex_encode (hex, digest, SHA256_DIGEST_LENGTH, '\0');
+	fwrite (hex, 1, sizeof(hex), stdout);
 }
 
-/* match the hash in the hash array and return the index if matched */
-static int
-match_hash_array (const efi_guid_t *hash_type, const void *hash,
-		  const void *hash_array, const uint32_t array_size)
+static void
+json_print_hex (FILE *fp, const uint8_t *data, uint32_t size)
 {
-	uint32_t hash_size, hash_count;
-	uint32_t sig_size;
-	void *ptr;
+	char hex[EVP_MAX_MD_SIZE * 2];
 
-	hash_size = efi_hash_size (hash_type);
-	if (!hash_size)
-		return -1;
+	fputc ('"', fp);
+	while (size > 0) {
+		uint32_t chunk = size < EVP_MAX_MD_SIZE ? size : EVP_MAX_MD_SIZE;
 
-	sig_size = hash_size + sizeof(efi_guid_t);
-	if ((array_size % sig_size) != 0) {
-		fprintf (stderr, "invalid hash array size\n");
-		return -1;
+		fwrite (hex, 1, hex_encode (hex, data, chunk, '\0'), fp);
+		data += chunk;
+		size -= chunk;
+	}
+	fputc ('"', fp);
+}
+
+static void
+json_print_guid (FILE *fp, const efi_guid_t *guid)
+{
+	char *guid_str = NULL;
+
+	if (efi_guid_to_str (guid, &guid_str) < 0 || !guid_str) {
+		fprintf (fp, "null");
+		return;
+	}
+	json_print_string (fp, guid_str);
+	free (guid_str);
+}
+
+static void
+json_print_x509_name (FILE *fp, X509_NAME *name)
+{
+	BIO *bio;
+	char *str;
+	long len;
+
+	bio = BIO_new (BIO_s_mem ());
+	if (!bio || X509_NAME_print_ex (bio, name, 0, XN_FLAG_RFC2253) < 0) {
+		fprintf (fp, "null");
+		BIO_free (bio);
+		return;
+	}
+	BIO_write (bio, "", 1);
+	len = BIO_get_mem_data (bio, &str);
+	if (len > 0)
+		json_print_string (fp, str);
+	else
+		fprintf (fp, "null");
+	BIO_free (bio);
+}
+
+static void
+json_print_asn1_time (FILE *fp, const ASN1_TIME *t)
+{
+	char buf[32];
+	struct tm tm;
+	time_t epoch;
+
+	if (asn1_time_to_epoch (t, &epoch) < 0 || !gmtime_r (&epoch, &tm)) {
+		fprintf (fp, "null");
+		return;
+	}
+	strftime (buf, sizeof(buf), "%Y-%m-%dT%H:%M:%SZ", &tm);
+	json_print_string (fp, buf);
+}
+
+static void
+json_print_serial (FILE *fp, const ASN1_INTEGER *serial)
+{
+	BIGNUM *bn;
+	char *hex;
+
+	bn = ASN1_INTEGER_to_BN (serial, NULL);
+	hex = bn ? BN_bn2hex (bn) : NULL;
+	if (hex) {
+		for (char *c = hex; *c; c++)
+			*c = tolower (*c);
+		json_print_string (fp, hex);
+		OPENSSL_free (hex);
+	} else {
+		fprintf (fp, "null");
+	}
+	BN_free (bn);
+}
+
+static void
+json_print_bool (FILE *fp, int32_t value)
+{
+	if (value < 0)
+		fprintf (fp, "null");
+	else
+		fprintf (fp, value ? "true" : "false");
+}
+
+static int
+print_x509_json (FILE *fp, const uint8_t *cert, uint32_t cert_size)
+{
+	const unsigned char *der = cert;
+	uint8_t fingerprint[EVP_MAX_MD_SIZE];
+	unsigned int fp_size;
+	X509 *X509cert;
+
+	X509cert = d2i_X509 (NULL, &der, cert_size);
+	if (X509cert == NULL) {
+		fprintf (stderr, "Invalid X509 certificate\n");
+		fprintf (fp, ",\"valid\":false");
+		return -1;
+	}
+
+	EVP_Digest (cert, cert_size, fingerprint, &fp_size, EVP_sha1 (), NULL);
+	fprintf (fp, ",\"sha1\":");
+	json_print_hex (fp, fingerprint, fp_size);
+	EVP_Digest (cert, cert_size, fingerprint, &fp_size, EVP_sha256 (), NULL);
+	fprintf (fp, ",\"sha256\":");
+	json_print_hex (fp, fingerprint, fp_size);
+	fprintf (fp, ",\"subject\":");
+	json_print_x509_name (fp, X509_get_subject_name (X509cert));
+	fprintf (fp, ",\"issuer\":");
+	json_print_x509_name (fp, X509_get_issuer_name (X509cert));
+	fprintf (fp, ",\"serial\":");
+	json_print_serial (fp, X509_get_serialNumber (X509cert));
+	fprintf (fp, ",\"not_before\":");
+	json_print_asn1_time (fp, X509_get0_notBefore (X509cert));
+	fprintf (fp, ",\"not_after\":");
+	json_print_asn1_time (fp, X509_get0_notAfter (X509cert));
+
+	X509_free (X509cert);
+
+	return 0;
+}
+
+static int
+print_hash_array_json (FILE *fp, efi_guid_t *hash_type, void *hash_array,
+		       uint32_t array_size)
+{
+	uint32_t hash_size, sig_size, remain;
+	EFI_SIGNATURE_DATA *sig;
+	efi_guid_t owner_guid;
+	char *owner = NULL;
+	uint8_t *hash;
+	OutBuf *ob;
+
+	hash_size = efi_hash_size (hash_type);
+	sig_size = hash_size + sizeof(efi_guid_t);
+	if (!hash_array || hash_size == 0 || array_size % sig_size != 0) {
+		fprintf (stderr, "invalid hash array\n");
+		fprintf (fp, ",\"hashes\":[]");
+		return -1;
+	}
+
+	ob = malloc (sizeof(OutBuf));
+	if (!ob) {
+		fprintf (stderr, "Failed to allocate buffer: %m\n");
+		return -1;
+	}
+	ob->fp = fp;
+	ob->len = 0;
+
+	outbuf_put (ob, ",\"hashes\":[", 11);
+	hash = (uint8_t *)hash_array;
+	for (remain = array_size; remain > 0; remain -= sig_size) {
+		sig = (EFI_SIGNATURE_DATA *)hash;
+		if (remain != array_size)
+			outbuf_put (ob, ",", 1);
+
+		/* The owners of a list are usually all the same */
+		if (!owner || memcmp (&owner_guid, &sig->SignatureOwner,
+				      sizeof(efi_guid_t)) != 0) {
+			free (owner);
+			owner = NULL;
+			memcpy (&owner_guid, &sig->SignatureOwner, sizeof(efi_guid_t));
+			if (efi_guid_to_str (&owner_guid, &owner) < 0)
+				owner = NULL;
+		}
+		outbuf_put (ob, "{\"owner\":", 9);
+		if (owner) {
+			outbuf_put (ob, "\"", 1);
+			outbuf_put (ob, owner, strlen (owner));
+			outbuf_put (ob, "\"", 1);
+		} else {
+			outbuf_put (ob, "null", 4);
+		}
+		outbuf_put (ob, ",\"digest\":\"", 11);
+		outbuf_hex (ob, sig->SignatureData, hash_size);
+		outbuf_put (ob, "\"}", 2);
+		hash += sig_size;
+	}
+	outbuf_put (ob, "]", 1);
+
+	outbuf_flush (ob);
+	free (ob);
+	free (owner);
+
+	return 0;
+}
+
+static void
+print_key (FILE *fp, OutputFormat format, MokListNode *node, unsigned int index,
+	   int first, int last)
+{
+	EFI_SIGNATURE_DATA *sig;
+	int is_x509, type;
+
+	is_x509 = efi_guid_cmp (&node->header->SignatureType, &efi_guid_x509_cert) == 0;
+	type = signature_type_index (&node->header->SignatureType);
+
+	switch (format) {
+	case OUTPUT_JSON:
+		if (!first)
+			fputc (',', fp);
+		fprintf (fp, "\n{\"index\":%u,\"type\":\"%s\"", index + 1,
+			 sig_types[type].name);
+		if (is_x509) {
+			sig = (EFI_SIGNATURE_DATA *)((uint8_t *)node->mok -
+						     sizeof(efi_guid_t));
+			fprintf (fp, ",\"owner\":");
+			json_print_guid (fp, &sig->SignatureOwner);
+			print_x509_json (fp, node->mok, node->mok_size);
+		} else {
+			print_hash_array_json (fp, &node->header->SignatureType,
+					       node->mok, node->mok_size);
+		}
+		fputc ('}', fp);
+		break;
+	case OUTPUT_SHORT:
+		fprintf (fp, "[key %d] ", index + 1);
+		if (is_x509) {
+			print_x509_short (fp, node->mok, node->mok_size);
+		} else {
+			fprintf (fp, "[%s] %u hash(es)\n", sig_types[type].name,
+				 node->mok_size / node->header->SignatureSize);
+		}
+		break;
+	case OUTPUT_TEXT:
+		fprintf (fp, "[key %d]\n", index + 1);
+		if (is_x509) {
+			print_x509 (fp, (char *)node->mok, node->mok_size);
+		} else {
+			print_hash_array (fp, &node->header->SignatureType,
+					  node->mok, node->mok_size);
+		}
+		if (!last)
+			fprintf (fp, "\n");
+		break;
+	}
+}
+
+typedef struct {
+	MokListNode  *list;
+	uint32_t      start;
+	uint32_t      count;
+	char        **buf;
+	size_t       *buf_size;
+} KeyListing;
+
+static void
+render_key (void *ctx, unsigned int index)
+{
+	KeyListing *listing = ctx;
+	FILE *fp;
+
+	fp = open_memstream (&listing->buf[index], &listing->buf_size[index]);
+	if (!fp) {
+		fprintf (stderr, "Failed to allocate buffer: %m\n");
+		listing->buf[index] = NULL;
+		return;
+	}
+
+	print_key (fp, output_format, &listing->list[listing->start + index],
+		   listing->start + index, index == 0,
+		   index == listing->count - 1);
+	fclose (fp);
+}
+
+static void
+write_key (void *ctx, unsigned int index)
+{
+	KeyListing *listing = ctx;
+
+	if (!listing->buf[index])
+		return;
+
+	fwrite (listing->buf[index], 1, listing->buf_size[index], stdout);
+	free (listing->buf[index]);
+}
+
+/* Whether --index or --range picked the keys to list */
+static int
+has_key_range ()
+{
+	return key_index_first != 1 || key_index_last != UINT32_MAX;
+}
+
+static int
+list_keys (const char *var_name, uint8_t *data, size_t data_size)
+{
+	KeyListing listing;
+	uint32_t mok_num = 0;
+	uint32_t start, end;
+	MokListNode *list = NULL;
+
+	if (data) {
+		list = build_mok_list (data, data_size, &mok_num);
+		if (list == NULL)
+			return -1;
+	}
+
+	/* Only the selected keys get decoded */
+	start = key_index_first - 1;
+	end = key_index_last < mok_num ? key_index_last : mok_num;
+	if (start >= mok_num && (mok_num > 0 || has_key_range ())) {
+		fprintf (stderr, "%s has only %u key(s)\n", var_name, mok_num);
+		free (list);
+		return -1;
+	} else if (mok_num == 0) {
+		start = end = 0;
+	}
+
+	if (output_format == OUTPUT_JSON) {
+		printf ("{\"variable\":");
+		json_print_string (stdout, var_name);
+		printf (",\"entries\":[");
+	}
+
+	if (worker_count (end - start) <= 1) {
+		/* Nothing to gain from the threads, print directly */
+		for (unsigned int i = start; i < end; i++)
+			print_key (stdout, output_format, &list[i], i, i == start,
+				   i == end - 1);
+	} else {
+		/* Decode and render the keys in parallel, but write them in
+		 * the original order */
+		listing.list = list;
+		listing.start = start;
+		listing.count = end - start;
+		listing.buf = calloc (listing.count, sizeof(char *));
+		listing.buf_size = calloc (listing.count, sizeof(size_t));
+		if (!listing.buf || !listing.buf_size) {
+			fprintf (stderr, "Failed to allocate buffer: %m\n");
+			free (listing.buf);
+			free (listing.buf_size);
+			free (list);
+			return -1;
+		}
+
+		run_parallel (listing.count, render_key, write_key, &listing);
+
+		free (listing.buf);
+		free (listing.buf_size);
+	}
+
+	if (output_format == OUTPUT_JSON)
+		printf ("\n]}\n");
+
+	if (list)
+		free (list);
+
+	return 0;
+}
+
+/* match the hash in the hash array and return the index if matched */
+static int
+match_hash_array (const efi_guid_t *hash_type, const void *hash,
+		  const void *hash_array, const uint32_t array_size)
+{
+	uint32_t hash_size, hash_count;
+	uint32_t sig_size;
+	void *ptr;
+
+	hash_size = efi_hash_size (hash_type);
+	if (!hash_size)
+		return -1;
+
+	sig_size = hash_size + sizeof(efi_guid_t);
+	if ((array_size % sig_size) != 0) {
+		fprintf (stderr, "invalid hash array size\n");
+		return -1;
 	}
 
 	ptr = (void *)hash_array;
@@ -488,20 +1559,93 @@ match_hash_array (const efi_guid_t *hash_type, const void *hash,
 	return -1;
 }
 
+/* A key or hash to remove with delete_data_from_lists() */
+typedef struct {
+	const efi_guid_t *type;
+	const void       *data;
+	uint32_t          size;
+	int               removed;
+} DeleteTarget;
+
+static int
+cmp_delete_target (const DeleteTarget *x, const DeleteTarget *y)
+{
+	int ret;
+
+	ret = memcmp (x->type, y->type, sizeof(efi_guid_t));
+	if (ret)
+		return ret;
+
+	if (x->size != y->size)
+		return x->size < y->size ? -1 : 1;
+
+	return memcmp (x->data, y->data, x->size);
+}
+
+static int
+cmp_delete_target_ptr (const void *a, const void *b)
+{
+	const DeleteTarget *x = *(const DeleteTarget **)a;
+	const DeleteTarget *y = *(const DeleteTarget **)b;
+	int ret;
+
+	ret = cmp_delete_target (x, y);
+	if (ret)
+		return ret;
+
+	/* Equal targets are removed in the order they were given */
+	return x < y ? -1 : x > y;
+}
+
+/* Find a target matching "key" that is not removed yet */
+static DeleteTarget *
+find_delete_target (DeleteTarget **sorted, unsigned int num,
+		    const DeleteTarget *key)
+{
+	unsigned int lo = 0, hi = num, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (cmp_delete_target (sorted[mid], key) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	/* The same key may be given more than once */
+	for (; lo < num && cmp_delete_target (sorted[lo], key) == 0; lo++) {
+		if (!sorted[lo]->removed)
+			return sorted[lo];
+	}
+
+	return NULL;
+}
+
+/* Remove one occurrence of every target from the variable in a single
+ * pass over the signature lists, and write the result back once. Lists
+ * left without any signature are dropped, and the variable is deleted
+ * together with its password if nothing is left. Returns the number of
+ * targets removed, or -1 on error. */
 static int
-delete_data_from_list (const efi_guid_t *var_guid, const char *var_name,
-		       const efi_guid_t *type, void *data, uint32_t data_size)
+delete_data_from_lists (const efi_guid_t *var_guid, const char *var_name,
+			DeleteTarget *targets, unsigned int num)
 {
 	uint8_t *var_data = NULL;
 	size_t var_data_size = 0;
+	uint8_t *new_data = NULL;
+	size_t new_size = 0;
 	uint32_t attributes;
-	MokListNode *list;
-	uint32_t mok_num, total, remain;
-	void *end, *start = NULL;
-	int del_ind, ret = 0;
-	uint32_t sig_list_size, sig_size;
+	DeleteTarget **sorted = NULL;
+	DeleteTarget *target, key;
+	EFI_SIGNATURE_LIST *CertList = NULL;
+	EFI_SIGNATURE_LIST *NewList;
+	EFI_SIGNATURE_DATA *Cert;
+	unsigned int sorted_num = 0, removed = 0;
+	uint32_t head_size, list_size, list_removed;
+	int corrupted;
+	int ret;
 
-	if (!var_name || !data || data_size == 0)
+	if (!var_name || num == 0)
 		return 0;
 
 	ret = efi_get_variable (*var_guid, var_name, &var_data, &var_data_size,
@@ -514,62 +1658,76 @@ delete_data_from_list (const efi_guid_t *var_guid, const char *var_name,
 		return -1;
 	}
 
-	total = var_data_size;
+	ret = -1;
 
-	list = build_mok_list (var_data, var_data_size, &mok_num);
-	if (list == NULL)
+	sorted = malloc (num * sizeof(DeleteTarget *));
+	new_data = malloc (var_data_size);
+	if (!sorted || !new_data) {
+		fprintf (stderr, "Failed to allocate space for %s: %m\n",
+			 var_name);
 		goto done;
+	}
 
-	remain = total;
-	for (unsigned int i = 0; i < mok_num; i++) {
-		remain -= list[i].header->SignatureListSize;
-		if (efi_guid_cmp (&list[i].header->SignatureType, type) != 0)
-			continue;
-
-		sig_list_size = list[i].header->SignatureListSize;
-
-		if (efi_guid_cmp (type, &efi_guid_x509_cert) == 0) {
-			if (list[i].mok_size != data_size)
+	for (unsigned int i = 0; i < num; i++) {
+		targets[i].removed = 0;
+		if (targets[i].data && targets[i].size > 0)
+			sorted[sorted_num++] = &targets[i];
+	}
+	qsort (sorted, sorted_num, sizeof(DeleteTarget *),
+	       cmp_delete_target_ptr);
+
+	while ((CertList = next_signature_list (var_data, var_data_size,
+						CertList, &corrupted))) {
+		NewList = (EFI_SIGNATURE_LIST *)(new_data + new_size);
+		head_size = sizeof(EFI_SIGNATURE_LIST) +
+			    CertList->SignatureHeaderSize;
+		list_size = head_size;
+		list_removed = 0;
+
+		memcpy (NewList, CertList, head_size);
+
+		key.type = &CertList->SignatureType;
+		key.size = CertList->SignatureSize - sizeof(efi_guid_t);
+		for (uint32_t n = 0; n < signature_count (CertList); n++) {
+			Cert = signature_at (CertList, n);
+			key.data = Cert->SignatureData;
+
+			target = find_delete_target (sorted, sorted_num, &key);
+			if (target) {
+				target->removed = 1;
+				list_removed++;
 				continue;
-
-			if (memcmp (list[i].mok, data, data_size) == 0) {
-				/* Remove this key */
-				start = (void *)list[i].header;
-				end = start + sig_list_size;
-				total -= sig_list_size;
-				break;
 			}
-		} else {
-			del_ind = match_hash_array (type, data, list[i].mok,
-						    list[i].mok_size);
-			if (del_ind < 0)
-				continue;
 
-			start = (void *)list[i].header;
-			sig_size = signature_size (type);
-			if (sig_list_size == (sizeof(EFI_SIGNATURE_LIST) + sig_size)) {
-				/* Only one hash in the list */
-				end = start + sig_list_size;
-				total -= sig_list_size;
-			} else {
-				/* More than one hash in the list */
-				start += sizeof(EFI_SIGNATURE_LIST) + sig_size * del_ind;
-				end = start + sig_size;
-				total -= sig_size;
-				list[i].header->SignatureListSize -= sig_size;
-				remain += sig_list_size - sizeof(EFI_SIGNATURE_LIST) -
-					  (del_ind + 1) * sig_size;
-			}
-			break;
+			memcpy ((uint8_t *)NewList + list_size, Cert,
+				CertList->SignatureSize);
+			list_size += CertList->SignatureSize;
+		}
+
+		if (list_removed == 0) {
+			/* Keep the list exactly as it is */
+			memcpy (NewList, CertList, CertList->SignatureListSize);
+			new_size += CertList->SignatureListSize;
+		} else if (list_size > head_size) {
+			NewList->SignatureListSize = list_size;
+			new_size += list_size;
 		}
+		removed += list_removed;
+	}
+	if (corrupted) {
+		fprintf (stderr, "Corrupted signature list in %s\n", var_name);
+		ret = 0;
+		goto done;
 	}
 
-	/* the key or hash is not in this list */
-	if (start == NULL)
-		return 0;
+	/* none of the keys or hashes is in this variable */
+	if (removed == 0) {
+		ret = 0;
+		goto done;
+	}
 
 	/* all keys are removed */
-	if (total == 0) {
+	if (new_size == 0) {
 		test_and_delete_var (var_name);
 
 		/* delete the password */
@@ -582,19 +1740,15 @@ delete_data_from_list (const efi_guid_t *var_guid, const char *var_name,
 		else if (strcmp (var_name, "MokXDel") == 0)
 			test_and_delete_var ("MokXDelAuth");
 
-		ret = 1;
+		ret = removed;
 		goto done;
 	}
 
-	/* remove the key or hash  */
-	if (remain > 0)
-		memmove (start, end, remain);
-
 	attributes = EFI_VARIABLE_NON_VOLATILE
 		     | EFI_VARIABLE_BOOTSERVICE_ACCESS
 		     | EFI_VARIABLE_RUNTIME_ACCESS;
 	ret = efi_set_variable (*var_guid, var_name,
-				var_data, total, attributes,
+				new_data, new_size, attributes,
 				S_IRUSR | S_IWUSR);
 	if (ret < 0) {
 		fprintf (stderr, "Failed to write variable \"%s\": %m\n",
@@ -603,10 +1757,14 @@ delete_data_from_list (const efi_guid_t *var_guid, const char *var_name,
 	}
 	efi_chmod_variable(*var_guid, var_name, S_IRUSR | S_IWUSR);
 
-	ret = 1;
+	ret = removed;
 done:
-	if (list)
-		free (list);
+	if (ret < 0) {
+		for (unsigned int i = 0; i < num; i++)
+			targets[i].removed = 0;
+	}
+	free (sorted);
+	free (new_data);
 	free (var_data);
 
 	return ret;
@@ -623,6 +1781,8 @@ list_keys_in_var (const char *var_name, const efi_guid_t guid)
 	ret = efi_get_variable (guid, var_name, &data, &data_size, &attributes);
 	if (ret < 0) {
 		if (errno == ENOENT) {
+			if (output_format == OUTPUT_JSON || has_key_range ())
+				return list_keys (var_name, NULL, 0);
 			printf ("%s is empty\n", var_name);
 			return 0;
 		}
@@ -631,7 +1791,7 @@ list_keys_in_var (const char *var_name, const efi_guid_t guid)
 		return -1;
 	}
 
-	ret = list_keys (data, data_size);
+	ret = list_keys (var_name, data, data_size);
 	free (data);
 
 	return ret;
@@ -1009,6 +2169,38 @@ error:
 	return ret;
 }
 
+static inline int
+read_file(int fd, void **bufp, size_t *lenptr) {
+	int alloced = 0, size = 0, i = 0;
+	void *buf = NULL;
+	void *buf_new = NULL;
+
+	do {
+		size += i;
+		if ((size + 1024) > alloced) {
+			alloced += 4096;
+			buf_new = realloc (buf, alloced + 1);
+			if (buf_new) {
+				buf = buf_new;
+			} else {
+				if (buf)
+					free (buf);
+				return -1;
+			}
+		}
+	} while ((i = read (fd, buf + size, 1024)) > 0);
+
+	if (i < 0) {
+		free (buf);
+		return -1;
+	}
+
+	*bufp = buf;
+	*lenptr = size;
+
+	return 0;
+}
+
 static int
 is_valid_cert (void *cert, uint32_t cert_size)
 {
@@ -1027,11 +2219,36 @@ is_valid_cert (void *cert, uint32_t cert_size)
 		return 0;
 	}
 
+	X509_free (X509cert);
 	BIO_free (cert_bio);
 
 	return 1;
 }
 
+static int
+list_contains (const MokListNode *list, uint32_t node_num,
+	       const efi_guid_t *type, const void *data, uint32_t data_size)
+{
+	for (unsigned int i = 0; i < node_num; i++) {
+		if (efi_guid_cmp (&list[i].header->SignatureType, type) != 0)
+			continue;
+
+		if (efi_guid_cmp (type, &efi_guid_x509_cert) == 0) {
+			if (list[i].mok_size != data_size)
+				continue;
+
+			if (memcmp (list[i].mok, data, data_size) == 0)
+				return 1;
+		} else {
+			if (match_hash_array (type, data, list[i].mok,
+					      list[i].mok_size) >= 0)
+				return 1;
+		}
+	}
+
+	return 0;
+}
+
 static int
 is_duplicate (const efi_guid_t *type, const void *data, const uint32_t data_size,
 	      const efi_guid_t *vendor, const char *db_name)
@@ -1051,80 +2268,413 @@ is_duplicate (const efi_guid_t *type, const void *data, const uint32_t data_size
 	if (ret < 0)
 		return 0;
 
+	ret = 0;
 	list = build_mok_list (var_data, var_data_size, &node_num);
-	if (list == NULL) {
-		goto done;
+	if (list) {
+		ret = list_contains (list, node_num, type, data, data_size);
+		free (list);
 	}
+	free (var_data);
 
-	for (unsigned int i = 0; i < node_num; i++) {
-		if (efi_guid_cmp (&list[i].header->SignatureType, type) != 0)
-			continue;
+	return ret;
+}
 
-		if (efi_guid_cmp (type, &efi_guid_x509_cert) == 0) {
-			if (list[i].mok_size != data_size)
-				continue;
+typedef struct {
+	MokRequest        req;
+	const efi_guid_t *guid;
+	const char       *name;
+	int               required;
+	const char       *skip_message;
+	int               revoked;
+} RequestCheck;
+
+/* A key is only worth adding to a request if it's in every "required"
+ * variable and in none of the others. The checks run in this order.
+ * Enrolling a key that dbx or MokListX revokes is pointless as well. */
+static const RequestCheck request_checks[] = {
+	{ ENROLL_MOK, &efi_guid_security, "dbx", 0, "is revoked in dbx", 1 },
+	{ ENROLL_MOK, &efi_guid_shim, "MokListXRT", 0, "is revoked in MokListX", 1 },
+	{ ENROLL_MOK, &efi_guid_global, "PK", 0, "is already in PK", 0 },
+	{ ENROLL_MOK, &efi_guid_global, "KEK", 0, "is already in KEK", 0 },
+	{ ENROLL_MOK, &efi_guid_security, "db", 0, "is already in db", 0 },
+	{ ENROLL_MOK, &efi_guid_shim, "MokListRT", 0, "is already enrolled", 0 },
+	{ ENROLL_MOK, &efi_guid_shim, "MokNew", 0,
+	  "is already in the enrollement request", 0 },
+	{ DELETE_MOK, &efi_guid_shim, "MokListRT", 1, "is not in MokList", 0 },
+	{ DELETE_MOK, &efi_guid_shim, "MokDel", 0,
+	  "is already in the deletion request", 0 },
+	{ ENROLL_BLACKLIST, &efi_guid_shim, "MokListXRT", 0, "is already in MokListX", 0 },
+	{ ENROLL_BLACKLIST, &efi_guid_shim, "MokXNew", 0,
+	  "is already in the MokX enrollment request", 0 },
+	{ DELETE_BLACKLIST, &efi_guid_shim, "MokListXRT", 1, "is not in MokListX", 0 },
+	{ DELETE_BLACKLIST, &efi_guid_shim, "MokXDel", 0,
+	  "is already in the MokX deletion request", 0 },
+};
+#define REQUEST_CHECK_NUM (sizeof(request_checks)/sizeof(request_checks[0]))
+#define MAX_REQUEST_CHECKS 7
 
-			if (memcmp (list[i].mok, data, data_size) == 0) {
-				ret = 1;
-				break;
+/* A hash found in one of the variables of a request snapshot. "tbs" is
+ * set for the EFI_CERT_X509_SHA* hashes of a TBSCertificate. */
+typedef struct {
+	const uint8_t *hash;
+	uint32_t       size;
+	uint8_t        tbs;
+	uint8_t        check;
+} HashIndexEntry;
+
+/* The variables a request is checked against, read once up front */
+typedef struct {
+	unsigned int        num;
+	const RequestCheck *checks[MAX_REQUEST_CHECKS];
+	EfiVarEntry         vars[MAX_REQUEST_CHECKS];
+	MokListNode        *lists[MAX_REQUEST_CHECKS];
+	uint32_t            node_nums[MAX_REQUEST_CHECKS];
+	HashIndexEntry     *hash_index;
+	uint32_t            hash_index_num;
+} RequestSnapshot;
+
+static int
+cmp_hash_index (const void *a, const void *b)
+{
+	const HashIndexEntry *x = a;
+	const HashIndexEntry *y = b;
+	int ret;
+
+	if (x->tbs != y->tbs)
+		return x->tbs < y->tbs ? -1 : 1;
+
+	if (x->size != y->size)
+		return x->size < y->size ? -1 : 1;
+
+	ret = memcmp (x->hash, y->hash, x->size);
+	if (ret)
+		return ret;
+
+	return x->check < y->check ? -1 : x->check > y->check;
+}
+
+/* The digest size of an EFI_CERT_X509_SHA* signature, or 0 */
+static uint32_t
+tbs_hash_size (const efi_guid_t *type)
+{
+	if (efi_guid_cmp (type, &efi_guid_x509_sha256) == 0)
+		return SHA256_DIGEST_LENGTH;
+	else if (efi_guid_cmp (type, &efi_guid_x509_sha384) == 0)
+		return SHA384_DIGEST_LENGTH;
+	else if (efi_guid_cmp (type, &efi_guid_x509_sha512) == 0)
+		return SHA512_DIGEST_LENGTH;
+
+	return 0;
+}
+
+/* Index every hash in the snapshot, so a certificate can be matched
+ * against the hash lists by its digests. Fails if a variable can't be
+ * parsed, as a hash missing from the index would go unnoticed. */
+static int
+build_hash_index (RequestSnapshot *snap)
+{
+	EFI_SIGNATURE_LIST *CertList;
+	HashIndexEntry *index = NULL;
+	uint32_t num = 0, n;
+	uint32_t hash_size;
+	int tbs, corrupted;
+
+	snap->hash_index = NULL;
+	snap->hash_index_num = 0;
+
+	/* Count, then fill */
+	for (int pass = 0; pass < 2; pass++) {
+		n = 0;
+		for (unsigned int i = 0; i < snap->num; i++) {
+			CertList = NULL;
+			while ((CertList = next_signature_list (snap->vars[i].data,
+								snap->vars[i].size,
+								CertList,
+								&corrupted))) {
+				hash_size = efi_hash_size (&CertList->SignatureType);
+				tbs = 0;
+				if (hash_size == 0) {
+					/* the hash is followed by an EFI_TIME */
+					hash_size = tbs_hash_size (&CertList->SignatureType);
+					tbs = 1;
+				}
+				if (hash_size == 0 ||
+				    CertList->SignatureSize != sizeof(efi_guid_t) +
+							       hash_size +
+							       (tbs ? sizeof(EFI_TIME) : 0))
+					continue;
+
+				for (uint32_t k = 0; k < signature_count (CertList); k++) {
+					if (index) {
+						index[n].hash = signature_at (CertList, k)->SignatureData;
+						index[n].size = hash_size;
+						index[n].tbs = tbs;
+						index[n].check = i;
+					}
+					n++;
+				}
 			}
-		} else {
-			if (match_hash_array (type, data, list[i].mok,
-					      list[i].mok_size) >= 0) {
-				ret = 1;
-				break;
+			if (corrupted) {
+				fprintf (stderr, "Corrupted signature list in %s\n",
+					 snap->vars[i].name);
+				free (index);
+				return -1;
+			}
+		}
+
+		if (pass == 0) {
+			if (n == 0)
+				return 0;
+			index = malloc (n * sizeof(HashIndexEntry));
+			if (!index) {
+				fprintf (stderr, "Failed to allocate space: %m\n");
+				return -1;
 			}
 		}
+		num = n;
 	}
 
-done:
-	if (list)
-		free (list);
-	free (var_data);
+	qsort (index, num, sizeof(HashIndexEntry), cmp_hash_index);
+	snap->hash_index = index;
+	snap->hash_index_num = num;
 
-	return ret;
+	return 0;
+}
+
+/* Return a mask of the checks whose variable has the hash */
+static uint32_t
+match_hash_index (const RequestSnapshot *snap, const uint8_t *hash,
+		  uint32_t size, int tbs)
+{
+	HashIndexEntry key;
+	uint32_t lo, hi, mid;
+	uint32_t mask = 0;
+
+	key.hash = hash;
+	key.size = size;
+	key.tbs = tbs;
+	key.check = 0;
+
+	lo = 0;
+	hi = snap->hash_index_num;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (cmp_hash_index (&snap->hash_index[mid], &key) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (; lo < snap->hash_index_num; lo++) {
+		const HashIndexEntry *entry = &snap->hash_index[lo];
+
+		if (entry->tbs != key.tbs || entry->size != key.size ||
+		    memcmp (entry->hash, hash, key.size) != 0)
+			break;
+		mask |= 1U << entry->check;
+	}
+
+	return mask;
+}
+
+/* Return a mask of the checks whose variable has one of the hashes of the
+ * certificate: SHA-1 to SHA-512 of the whole certificate, or SHA-256 to
+ * SHA-512 of its TBSCertificate */
+static uint32_t
+match_cert_hashes (const RequestSnapshot *snap, const uint8_t *cert,
+		   uint32_t cert_size)
+{
+	static const struct {
+		int tbs;
+		uint32_t size;
+		const EVP_MD *(*md)(void);
+	} digests[] = {
+		{ 0, SHA_DIGEST_LENGTH, EVP_sha1 },
+		{ 0, SHA224_DIGEST_LENGTH, EVP_sha224 },
+		{ 0, SHA256_DIGEST_LENGTH, EVP_sha256 },
+		{ 0, SHA384_DIGEST_LENGTH, EVP_sha384 },
+		{ 0, SHA512_DIGEST_LENGTH, EVP_sha512 },
+		{ 1, SHA256_DIGEST_LENGTH, EVP_sha256 },
+		{ 1, SHA384_DIGEST_LENGTH, EVP_sha384 },
+		{ 1, SHA512_DIGEST_LENGTH, EVP_sha512 },
+	};
+	uint8_t hash[SHA512_DIGEST_LENGTH];
+	const uint8_t *tbs = NULL;
+	size_t tbs_size = 0;
+	uint32_t mask = 0;
+
+	if (snap->hash_index_num == 0)
+		return 0;
+
+	if (der_tbs_field (cert, cert_size, TBS_CERTIFICATE, &tbs,
+			   &tbs_size) < 0)
+		tbs = NULL;
+
+	for (unsigned int d = 0; d < sizeof(digests)/sizeof(digests[0]); d++) {
+		if (digests[d].tbs && !tbs)
+			continue;
+
+		if (!EVP_Digest (digests[d].tbs ? tbs : cert,
+				 digests[d].tbs ? tbs_size : cert_size,
+				 hash, NULL, digests[d].md (), NULL))
+			continue;
+
+		mask |= match_hash_index (snap, hash, digests[d].size,
+					  digests[d].tbs);
+	}
+
+	return mask;
+}
+
+/* Read the variables of the selected checks and index their keys. A
+ * variable that can't be parsed fails the snapshot, instead of letting
+ * the keys it revokes pass the checks. The variables that can't be read
+ * are left for the caller to report. */
+static int
+read_snapshot (RequestSnapshot *snap)
+{
+	read_var_entries (snap->vars, snap->num);
+
+	for (unsigned int i = 0; i < snap->num; i++) {
+		snap->lists[i] = NULL;
+		snap->node_nums[i] = 0;
+	}
+
+	/* This walks every signature list, so it finds the corrupted ones */
+	if (build_hash_index (snap) < 0)
+		return -1;
+
+	for (unsigned int i = 0; i < snap->num; i++) {
+		if (!snap->vars[i].data)
+			continue;
+
+		/* The count is only set on success, while a variable with
+		 * nothing but TBSCertificate hashes gives a NULL list */
+		snap->node_nums[i] = UINT32_MAX;
+		snap->lists[i] = build_mok_list (snap->vars[i].data,
+						 snap->vars[i].size,
+						 &snap->node_nums[i]);
+		if (snap->node_nums[i] == UINT32_MAX) {
+			snap->node_nums[i] = 0;
+			fprintf (stderr, "Corrupted signature list in %s\n",
+				 snap->vars[i].name);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void
+add_snapshot_check (RequestSnapshot *snap, const RequestCheck *check)
+{
+	snap->checks[snap->num] = check;
+	snap->vars[snap->num].guid = check->guid;
+	snap->vars[snap->num].name = check->name;
+	snap->num++;
+}
+
+static int
+load_request_snapshot (MokRequest req, RequestSnapshot *snap)
+{
+	snap->num = 0;
+	for (unsigned int i = 0; i < REQUEST_CHECK_NUM; i++) {
+		if (request_checks[i].req == req)
+			add_snapshot_check (snap, &request_checks[i]);
+	}
+
+	return read_snapshot (snap);
+}
+
+/* Only the variables that revoke keys */
+static int
+load_revocation_snapshot (RequestSnapshot *snap)
+{
+	snap->num = 0;
+	for (unsigned int i = 0; i < REQUEST_CHECK_NUM; i++) {
+		if (request_checks[i].revoked)
+			add_snapshot_check (snap, &request_checks[i]);
+	}
+
+	return read_snapshot (snap);
+}
+
+static void
+free_request_snapshot (RequestSnapshot *snap)
+{
+	for (unsigned int i = 0; i < snap->num; i++)
+		free (snap->lists[i]);
+	free (snap->hash_index);
+	free_var_entries (snap->vars, snap->num);
+}
+
+/* Return a mask of the checks the key fails. A certificate is also
+ * found through the hashes of it in the variable. */
+static uint32_t
+request_check_mask (const RequestSnapshot *snap, const efi_guid_t *type,
+		    const void *data, uint32_t data_size)
+{
+	uint32_t hashed = 0, indexed = 0, mask = 0;
+	uint32_t tbs_size;
+	int found;
+
+	if (efi_guid_cmp (type, &efi_guid_x509_cert) == 0)
+		hashed = match_cert_hashes (snap, data, data_size);
+	else if ((tbs_size = tbs_hash_size (type)))
+		/* The TBSCertificate hashes are only in the hash index */
+		indexed = match_hash_index (snap, data, tbs_size, 1);
+
+	for (unsigned int i = 0; i < snap->num; i++) {
+		found = ((indexed >> i) & 1) ||
+			(snap->lists[i] &&
+			 list_contains (snap->lists[i], snap->node_nums[i],
+					type, data, data_size));
+		/* A hash of the certificate makes enrolling it pointless, but
+		 * deleting the hash doesn't remove the certificate */
+		if (!found && (snap->checks[i]->req == ENROLL_MOK ||
+			       snap->checks[i]->req == ENROLL_BLACKLIST))
+			found = (hashed >> i) & 1;
+		if (found != snap->checks[i]->required)
+			mask |= 1U << i;
+	}
+
+	return mask;
+}
+
+/* Return the index of the first check the key fails, or -1 if the key
+ * can be added to the request */
+static int
+check_request (const RequestSnapshot *snap, const efi_guid_t *type,
+	       const void *data, uint32_t data_size)
+{
+	uint32_t mask = request_check_mask (snap, type, data, data_size);
+
+	return mask ? ffs (mask) - 1 : -1;
 }
 
 static int
 is_valid_request (const efi_guid_t *type, void *mok, uint32_t mok_size,
 		  MokRequest req)
 {
-	switch (req) {
-	case ENROLL_MOK:
-		if (is_duplicate (type, mok, mok_size, &efi_guid_global, "PK") ||
-		    is_duplicate (type, mok, mok_size, &efi_guid_global, "KEK") ||
-		    is_duplicate (type, mok, mok_size, &efi_guid_security, "db") ||
-		    is_duplicate (type, mok, mok_size, &efi_guid_shim, "MokListRT") ||
-		    is_duplicate (type, mok, mok_size, &efi_guid_shim, "MokNew")) {
-			return 0;
-		}
-		break;
-	case DELETE_MOK:
-		if (!is_duplicate (type, mok, mok_size, &efi_guid_shim, "MokListRT") ||
-		    is_duplicate (type, mok, mok_size, &efi_guid_shim, "MokDel")) {
-			return 0;
-		}
-		break;
-	case ENROLL_BLACKLIST:
-		if (is_duplicate (type, mok, mok_size, &efi_guid_shim, "MokListXRT") ||
-		    is_duplicate (type, mok, mok_size, &efi_guid_shim, "MokXNew")) {
-			return 0;
-		}
-		break;
-	case DELETE_BLACKLIST:
-		if (!is_duplicate (type, mok, mok_size, &efi_guid_shim, "MokListXRT") ||
-		    is_duplicate (type, mok, mok_size, &efi_guid_shim, "MokXDel")) {
+	const RequestCheck *check;
+
+	for (unsigned int i = 0; i < REQUEST_CHECK_NUM; i++) {
+		check = &request_checks[i];
+		if (check->req != req)
+			continue;
+
+		if (is_duplicate (type, mok, mok_size, check->guid,
+				  check->name) != check->required)
 			return 0;
-		}
-		break;
 	}
 
 	return 1;
 }
 
+/* Remove the targets from the pending request, if there is one with a
+ * new format password. Returns the number of targets removed. */
 static int
-in_pending_request (const efi_guid_t *type, void *data, uint32_t data_size,
-		    MokRequest req)
+in_pending_requests (DeleteTarget *targets, unsigned int num, MokRequest req)
 {
 	uint8_t *authvar_data;
 	size_t authvar_data_size;
@@ -1144,7 +2694,10 @@ in_pending_request (const efi_guid_t *type, void *data, uint32_t data_size,
 		[ENROLL_BLACKLIST] = "MokX"
 	};
 
-	if (!data || data_size == 0)
+	for (unsigned int i = 0; i < num; i++)
+		targets[i].removed = 0;
+
+	if (num == 0)
 		return 0;
 
 	if (efi_get_variable (efi_guid_shim, authvar_names[req], &authvar_data,
@@ -1156,192 +2709,454 @@ in_pending_request (const efi_guid_t *type, void *data, uint32_t data_size,
 	if (authvar_data_size == SHA256_DIGEST_LENGTH)
 		return 0;
 
-	ret = delete_data_from_list (&efi_guid_shim, var_names[req],
-				     type, data, data_size);
+	ret = delete_data_from_lists (&efi_guid_shim, var_names[req],
+				      targets, num);
 	if (ret < 0)
 		return -1;
 
 	return ret;
 }
 
-static void
-print_skip_message (const char *filename, void *mok, uint32_t mok_size,
+static int
+in_pending_request (const efi_guid_t *type, void *data, uint32_t data_size,
 		    MokRequest req)
 {
-	switch (req) {
-	case ENROLL_MOK:
-		if (is_duplicate (&efi_guid_x509_cert, mok, mok_size,
-				  &efi_guid_global, "PK"))
-			printf ("SKIP: %s is already in PK\n", filename);
-		else if (is_duplicate (&efi_guid_x509_cert, mok, mok_size,
-				       &efi_guid_global, "KEK"))
-			printf ("SKIP: %s is already in KEK\n", filename);
-		else if (is_duplicate (&efi_guid_x509_cert, mok, mok_size,
-				       &efi_guid_security, "db"))
-			printf ("SKIP: %s is already in db\n", filename);
-		else if (is_duplicate (&efi_guid_x509_cert, mok, mok_size,
-				       &efi_guid_shim, "MokListRT"))
-			printf ("SKIP: %s is already enrolled\n", filename);
-		else if (is_duplicate (&efi_guid_x509_cert, mok, mok_size,
-				       &efi_guid_shim, "MokNew"))
-			printf ("SKIP: %s is already in the enrollement request\n", filename);
-		break;
-	case DELETE_MOK:
-		if (!is_duplicate (&efi_guid_x509_cert, mok, mok_size,
-				   &efi_guid_shim, "MokListRT"))
-			printf ("SKIP: %s is not in MokList\n", filename);
-		else if (is_duplicate (&efi_guid_x509_cert, mok, mok_size,
-				       &efi_guid_shim, "MokDel"))
-			printf ("SKIP: %s is already in the deletion request\n", filename);
-		break;
-	case ENROLL_BLACKLIST:
-		if (is_duplicate (&efi_guid_x509_cert, mok, mok_size,
-				  &efi_guid_shim, "MokListXRT"))
-			printf ("SKIP: %s is already in MokListX\n", filename);
-		else if (is_duplicate (&efi_guid_x509_cert, mok, mok_size,
-				       &efi_guid_shim, "MokXNew"))
-			printf ("SKIP: %s is already in the MokX enrollment request\n", filename);
-		break;
-	case DELETE_BLACKLIST:
-		if (!is_duplicate (&efi_guid_x509_cert, mok, mok_size,
-				   &efi_guid_shim, "MokListXRT"))
-			printf ("SKIP: %s is not in MokListX\n", filename);
-		else if (is_duplicate (&efi_guid_x509_cert, mok, mok_size,
-				       &efi_guid_shim, "MokXDel"))
-			printf ("SKIP: %s is already in the MokX deletion request\n", filename);
-		break;
-	}
+	DeleteTarget target = {type, data, data_size, 0};
+
+	if (!data || data_size == 0)
+		return 0;
+
+	return in_pending_requests (&target, 1, req);
 }
 
+typedef enum {
+	ITEM_UNREAD = 0,
+	ITEM_UNREADABLE,
+	ITEM_INVALID,
+	ITEM_LOADED,
+} MokItemState;
+
+/* A certificate found in a key file */
+typedef struct {
+	uint8_t  *data;
+	uint32_t  size;
+	int       check;
+	int       repeated;
+} MokKey;
+
+/* A key file loaded for a request */
+typedef struct {
+	const char   *filename;
+	MokItemState  state;
+	int           err;
+	MokKey       *keys;
+	unsigned int  key_num;
+} MokItem;
+
+typedef struct {
+	MokItem         *items;
+	RequestSnapshot *snap;
+} MokLoad;
+
 static int
-issue_mok_request (char **files, uint32_t total, MokRequest req,
-		   const char *hash_file, const int root_pw)
+add_key (MokItem *item, const uint8_t *der, size_t size)
 {
-	uint8_t *old_req_data = NULL;
-	size_t old_req_data_size = 0;
-	uint32_t attributes;
-	void *new_list = NULL;
-	void *ptr;
-	struct stat buf;
-	unsigned long list_size = 0;
-	unsigned long real_size = 0;
-	uint32_t *sizes = NULL;
-	int fd = -1;
-	ssize_t read_size;
-	int ret = -1;
-	EFI_SIGNATURE_LIST *CertList;
-	EFI_SIGNATURE_DATA *CertData;
-	const char *req_names[] = {
-		[DELETE_MOK] = "MokDel",
-		[ENROLL_MOK] = "MokNew",
-		[DELETE_BLACKLIST] = "MokXDel",
-		[ENROLL_BLACKLIST] = "MokXNew"
-	};
-	const char *reverse_req_names[] = {
-		[DELETE_MOK] = "MokNew",
-		[ENROLL_MOK] = "MokDel",
-		[DELETE_BLACKLIST] = "MokXNew",
-		[ENROLL_BLACKLIST] = "MokXDel"
-	};
+	MokKey *keys_new;
+	MokKey *key;
 
-	if (!files)
+	if (size == 0 || size > UINT32_MAX)
 		return -1;
 
-	sizes = malloc (total * sizeof(uint32_t));
-	if (!sizes) {
-		fprintf (stderr, "Failed to allocate space for sizes\n");
-		goto error;
-	}
+	keys_new = realloc (item->keys, (item->key_num + 1) * sizeof(MokKey));
+	if (!keys_new)
+		return -1;
+	item->keys = keys_new;
 
-	/* get the sizes of the key files */
-	for (unsigned int i = 0; i < total; i++) {
-		if (stat (files[i], &buf) != 0) {
-			fprintf (stderr, "Failed to get file status, %s\n",
-			         files[i]);
-			goto error;
-		}
+	key = &item->keys[item->key_num];
+	memset (key, 0, sizeof(MokKey));
+	key->data = malloc (size);
+	if (!key->data)
+		return -1;
+	memcpy (key->data, der, size);
+	key->size = size;
+	item->key_num++;
 
-		sizes[i] = buf.st_size;
-		list_size += buf.st_size;
-	}
+	return 0;
+}
 
-	list_size += sizeof(EFI_SIGNATURE_LIST) * total;
-	list_size += sizeof(efi_guid_t) * total;
+/* Add every certificate of a PKCS#7 SignedData bundle */
+static int
+add_pkcs7_keys (MokItem *item, const uint8_t *der, long size)
+{
+	const unsigned char *ptr = der;
+	STACK_OF(X509) *certs = NULL;
+	unsigned char *cert_der;
+	PKCS7 *p7;
+	int len;
+	int ret = -1;
 
-	ret = efi_get_variable (efi_guid_shim, req_names[req], &old_req_data,
-				&old_req_data_size, &attributes);
-	if (ret < 0) {
-		if (errno != ENOENT) {
-			fprintf (stderr, "Failed to read variable \"%s\": %m\n",
-				 req_names[req]);
-			goto error;
-		}
-	} else {
-		list_size += old_req_data_size;
-	}
-	ret = -1;
+	p7 = d2i_PKCS7 (NULL, &ptr, size);
+	if (!p7)
+		return -1;
 
-	new_list = malloc (list_size);
-	if (!new_list) {
-		fprintf (stderr, "Failed to allocate space for %s\n",
-			 req_names[req]);
-		goto error;
+	if (PKCS7_type_is_signed (p7) && p7->d.sign)
+		certs = p7->d.sign->cert;
+
+	for (int i = 0; i < sk_X509_num (certs); i++) {
+		cert_der = NULL;
+		len = i2d_X509 (sk_X509_value (certs, i), &cert_der);
+		if (len <= 0 || add_key (item, cert_der, len) < 0) {
+			OPENSSL_free (cert_der);
+			goto done;
+		}
+		OPENSSL_free (cert_der);
 	}
-	ptr = new_list;
 
-	for (unsigned int i = 0; i < total; i++) {
-		CertList = ptr;
-		CertData = (EFI_SIGNATURE_DATA *)(((uint8_t *)ptr) +
-						  sizeof(EFI_SIGNATURE_LIST));
+	if (item->key_num > 0)
+		ret = 0;
+done:
+	PKCS7_free (p7);
 
-		CertList->SignatureType = efi_guid_x509_cert;
-		CertList->SignatureListSize = sizes[i] +
-		   sizeof(EFI_SIGNATURE_LIST) + sizeof(EFI_SIGNATURE_DATA) - 1;
-		CertList->SignatureHeaderSize = 0;
-		CertList->SignatureSize = sizes[i] + sizeof(efi_guid_t);
-		CertData->SignatureOwner = efi_guid_shim;
+	return ret;
+}
 
-		fd = open (files[i], O_RDONLY);
-		if (fd == -1) {
-			fprintf (stderr, "Failed to open %s\n", files[i]);
-			goto error;
-		}
+/* Add the certificates and PKCS#7 bundles of a PEM file, block by
+ * block. Other blocks such as private keys are ignored. */
+static int
+add_pem_keys (MokItem *item, const uint8_t *data, size_t size)
+{
+	BIO *bio;
+	char *name = NULL, *header = NULL;
+	unsigned char *der = NULL;
+	unsigned long err;
+	long len;
+	int ret = 0;
 
-		ptr = CertData->SignatureData;
+	bio = BIO_new_mem_buf (data, size);
+	if (!bio)
+		return -1;
 
-		/* Mok */
-		read_size = read (fd, ptr, sizes[i]);
-		if (read_size < 0 || read_size != (int64_t)sizes[i]) {
-			fprintf (stderr, "Failed to read %s\n", files[i]);
-			goto error;
-		}
-		if (!is_valid_cert (ptr, read_size)) {
-			fprintf (stderr, "Abort!!! %s is not a valid x509 certificate in DER format\n",
-			         files[i]);
-			goto error;
+	ERR_clear_error ();
+	while (ret == 0 && PEM_read_bio (bio, &name, &header, &der, &len)) {
+		if (strcmp (name, PEM_STRING_X509) == 0 ||
+		    strcmp (name, PEM_STRING_X509_OLD) == 0) {
+			if (!is_valid_cert (der, len) ||
+			    add_key (item, der, len) < 0)
+				ret = -1;
+		} else if (strcmp (name, PEM_STRING_PKCS7) == 0 ||
+			   strcmp (name, PEM_STRING_PKCS7_SIGNED) == 0) {
+			ret = add_pkcs7_keys (item, der, len);
 		}
 
-		if (is_valid_request (&efi_guid_x509_cert, ptr, sizes[i], req)) {
-			ptr += sizes[i];
-			real_size += sizes[i] + sizeof(EFI_SIGNATURE_LIST) + sizeof(efi_guid_t);
-		} else if (in_pending_request (&efi_guid_x509_cert, ptr, sizes[i], req)) {
-			printf ("Removed %s from %s\n", files[i],
-				reverse_req_names[req]);
-			ptr -= sizeof(EFI_SIGNATURE_LIST) + sizeof(efi_guid_t);
-		} else {
-			print_skip_message (files[i], ptr, sizes[i], req);
-			ptr -= sizeof(EFI_SIGNATURE_LIST) + sizeof(efi_guid_t);
-		}
+		OPENSSL_free (name);
+		OPENSSL_free (header);
+		OPENSSL_free (der);
+	}
+	/* PEM_read_bio() leaves "no start line" behind at the end, anything
+	 * else means a block it couldn't read */
+	err = ERR_peek_last_error ();
+	if (ret == 0 && err &&
+	    !(ERR_GET_LIB (err) == ERR_LIB_PEM &&
+	      ERR_GET_REASON (err) == PEM_R_NO_START_LINE)) {
+		fprintf (stderr, "%s is corrupted: %s\n", item->filename,
+			 ERR_reason_error_string (err));
+		ret = -1;
+	}
+	ERR_clear_error ();
+	BIO_free (bio);
+
+	if (item->key_num == 0)
+		ret = -1;
+
+	return ret;
+}
+
+/* Tell the format of a key file by its first bytes */
+static int
+is_pem (const uint8_t *data, size_t size)
+{
+	static const char pem_begin[] = "-----BEGIN ";
+	size_t i = 0;
+
+	while (i < size && isspace (data[i]))
+		i++;
+
+	return size - i >= sizeof(pem_begin) - 1 &&
+	       memcmp (data + i, pem_begin, sizeof(pem_begin) - 1) == 0;
+}
+
+static void
+free_mok_item (MokItem *item)
+{
+	for (unsigned int k = 0; k < item->key_num; k++)
+		free (item->keys[k].data);
+	free (item->keys);
+}
+
+/* Read a key file, split it into certificates and check them against the
+ * snapshot. A file is either a DER certificate, a DER PKCS#7 bundle or
+ * PEM with any number of certificates and PKCS#7 bundles. Runs on the
+ * worker threads, so it only touches its own item. */
+static void
+load_mok_item (void *ctx, unsigned int index)
+{
+	MokLoad *load = ctx;
+	MokItem *item = &load->items[index];
+	void *data;
+	size_t size;
+	int fd, rc;
+
+	/* Already set up by the caller, e.g. a hash for --test-key */
+	if (item->state != ITEM_UNREAD)
+		return;
 
+	fd = open (item->filename, O_RDONLY);
+	if (fd < 0) {
+		item->err = errno;
+		item->state = ITEM_UNREADABLE;
+		return;
+	}
+
+	if (read_file (fd, &data, &size) < 0 || size > UINT32_MAX) {
+		item->err = errno;
+		item->state = ITEM_UNREADABLE;
 		close (fd);
+		return;
+	}
+	close (fd);
+
+	if (is_pem (data, size))
+		rc = add_pem_keys (item, data, size);
+	else if (is_valid_cert (data, size))
+		rc = add_key (item, data, size);
+	else
+		rc = add_pkcs7_keys (item, data, size);
+	free (data);
+
+	if (rc < 0) {
+		item->state = ITEM_INVALID;
+		return;
+	}
+
+	for (unsigned int k = 0; k < item->key_num; k++)
+		item->keys[k].check = check_request (load->snap,
+						     &efi_guid_x509_cert,
+						     item->keys[k].data,
+						     item->keys[k].size);
+	item->state = ITEM_LOADED;
+}
+
+/* Name a key in the messages, by the file and its place in the file if
+ * the file has more than one */
+static const char *
+key_label (char *buf, size_t size, const MokItem *item, unsigned int k)
+{
+	if (item->key_num == 1)
+		return item->filename;
+
+	snprintf (buf, size, "%s (certificate %u)", item->filename, k + 1);
+
+	return buf;
+}
+
+/* Find an earlier key in the request with the same content */
+static const MokKey *
+find_repeated_key (const MokItem *items, unsigned int i, unsigned int k,
+		   unsigned int *prev_i, unsigned int *prev_k)
+{
+	const MokKey *key = &items[i].keys[k];
+	const MokKey *prev;
+
+	for (unsigned int j = 0; j <= i; j++) {
+		for (unsigned int l = 0; l < items[j].key_num; l++) {
+			if (j == i && l == k)
+				return NULL;
+			prev = &items[j].keys[l];
+			if (prev->check < 0 && !prev->repeated &&
+			    prev->size == key->size &&
+			    memcmp (prev->data, key->data, key->size) == 0) {
+				*prev_i = j;
+				*prev_k = l;
+				return prev;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+static int
+issue_mok_request (char **files, uint32_t total, MokRequest req,
+		   const char *hash_file, const int root_pw)
+{
+	uint8_t *old_req_data = NULL;
+	size_t old_req_data_size = 0;
+	void *new_list = NULL;
+	void *ptr;
+	unsigned long list_size = 0;
+	unsigned long real_size = 0;
+	RequestSnapshot snap;
+	MokItem *items = NULL;
+	MokLoad load;
+	DeleteTarget *pending = NULL;
+	unsigned int pending_num = 0, key_total = 0, p = 0;
+	int ret = -1;
+	EFI_SIGNATURE_LIST *CertList;
+	EFI_SIGNATURE_DATA *CertData;
+	const char *req_names[] = {
+		[DELETE_MOK] = "MokDel",
+		[ENROLL_MOK] = "MokNew",
+		[DELETE_BLACKLIST] = "MokXDel",
+		[ENROLL_BLACKLIST] = "MokXNew"
+	};
+	const char *reverse_req_names[] = {
+		[DELETE_MOK] = "MokNew",
+		[ENROLL_MOK] = "MokDel",
+		[DELETE_BLACKLIST] = "MokXNew",
+		[ENROLL_BLACKLIST] = "MokXDel"
+	};
+
+	if (!files)
+		return -1;
+
+	/* Read every variable the keys are checked against only once */
+	if (load_request_snapshot (req, &snap) < 0)
+		goto error;
+	for (unsigned int i = 0; i < snap.num; i++) {
+		if (snap.vars[i].err && snap.vars[i].err != ENOENT) {
+			errno = snap.vars[i].err;
+			fprintf (stderr, "Failed to read variable \"%s\": %m\n",
+				 snap.vars[i].name);
+			goto error;
+		}
+		/* The existing request is kept behind the new keys */
+		if (strcmp (snap.vars[i].name, req_names[req]) == 0) {
+			old_req_data = snap.vars[i].data;
+			old_req_data_size = snap.vars[i].size;
+		}
+	}
+
+	items = calloc (total, sizeof(MokItem));
+	if (!items) {
+		fprintf (stderr, "Failed to allocate space for the keys\n");
+		goto error;
+	}
+	for (unsigned int i = 0; i < total; i++)
+		items[i].filename = files[i];
+
+	/* Load and validate the files in parallel */
+	load.items = items;
+	load.snap = &snap;
+	run_parallel (total, load_mok_item, NULL, &load);
+
+	/* Take the keys that can't be added out of the reverse request with a
+	 * single write, up to the first file that aborts the request */
+	for (unsigned int i = 0; i < total && items[i].state == ITEM_LOADED; i++)
+		key_total += items[i].key_num;
+	pending = calloc (key_total + 1, sizeof(DeleteTarget));
+	if (!pending) {
+		fprintf (stderr, "Failed to allocate space for the keys\n");
+		goto error;
+	}
+	for (unsigned int i = 0; i < total && items[i].state == ITEM_LOADED; i++) {
+		for (unsigned int k = 0; k < items[i].key_num; k++) {
+			MokKey *key = &items[i].keys[k];
+
+			if (key->check < 0)
+				continue;
+			pending[pending_num].type = &efi_guid_x509_cert;
+			pending[pending_num].data = key->data;
+			pending[pending_num].size = key->size;
+			pending_num++;
+		}
+	}
+	in_pending_requests (pending, pending_num, req);
+
+	/* Everything else that prints is done in order */
+	for (unsigned int i = 0; i < total; i++) {
+		MokItem *item = &items[i];
+
+		switch (item->state) {
+		case ITEM_UNREADABLE:
+			errno = item->err;
+			fprintf (stderr, "Failed to read %s: %m\n", files[i]);
+			goto error;
+		case ITEM_INVALID:
+			fprintf (stderr, "Abort!!! %s is not a valid x509 certificate in DER, PEM or PKCS#7 format\n",
+			         files[i]);
+			goto error;
+		default:
+			break;
+		}
+
+		for (unsigned int k = 0; k < item->key_num; k++) {
+			MokKey *key = &item->keys[k];
+			char buf[PATH_MAX + 32], prev_buf[PATH_MAX + 32];
+			const char *label;
+			unsigned int prev_i, prev_k;
+
+			label = key_label (buf, sizeof(buf), item, k);
+
+			if (key->check < 0) {
+				/* The same key may be given more than once */
+				if (find_repeated_key (items, i, k, &prev_i, &prev_k)) {
+					key->repeated = 1;
+					printf ("SKIP: %s is the same key as %s\n",
+						label,
+						key_label (prev_buf, sizeof(prev_buf),
+							   &items[prev_i], prev_k));
+					continue;
+				}
+				list_size += sizeof(EFI_SIGNATURE_LIST) +
+					     sizeof(efi_guid_t) + key->size;
+			} else if (pending[p++].removed) {
+				printf ("Removed %s from %s\n", label,
+					reverse_req_names[req]);
+			} else {
+				printf ("SKIP: %s %s\n", label,
+					snap.checks[key->check]->skip_message);
+			}
+		}
 	}
 
 	/* All keys are in the list, nothing to do here... */
-	if (real_size == 0) {
+	if (list_size == 0) {
 		ret = 0;
 		goto error;
 	}
 
+	new_list = malloc (list_size + old_req_data_size);
+	if (!new_list) {
+		fprintf (stderr, "Failed to allocate space for %s\n",
+			 req_names[req]);
+		goto error;
+	}
+	ptr = new_list;
+
+	for (unsigned int i = 0; i < total; i++) {
+		for (unsigned int k = 0; k < items[i].key_num; k++) {
+			MokKey *key = &items[i].keys[k];
+
+			if (key->check >= 0 || key->repeated)
+				continue;
+
+			CertList = ptr;
+			CertData = (EFI_SIGNATURE_DATA *)(((uint8_t *)ptr) +
+							  sizeof(EFI_SIGNATURE_LIST));
+
+			CertList->SignatureType = efi_guid_x509_cert;
+			CertList->SignatureListSize = key->size +
+			   sizeof(EFI_SIGNATURE_LIST) + sizeof(EFI_SIGNATURE_DATA) - 1;
+			CertList->SignatureHeaderSize = 0;
+			CertList->SignatureSize = key->size + sizeof(efi_guid_t);
+			CertData->SignatureOwner = efi_guid_shim;
+
+			memcpy (CertData->SignatureData, key->data, key->size);
+			ptr = CertData->SignatureData + key->size;
+		}
+	}
+	real_size = list_size;
+
 	/* append the keys to the previous request */
 	if (old_req_data && old_req_data_size) {
 		memcpy (new_list + real_size, old_req_data, old_req_data_size);
@@ -1354,16 +3169,334 @@ issue_mok_request (char **files, uint32_t total, MokRequest req,
 
 	ret = 0;
 error:
-	if (sizes)
-		free (sizes);
-	if (old_req_data)
-		free (old_req_data);
+	if (items) {
+		for (unsigned int i = 0; i < total; i++)
+			free_mok_item (&items[i]);
+		free (items);
+	}
+	free_request_snapshot (&snap);
+	if (pending)
+		free (pending);
 	if (new_list)
 		free (new_list);
 
 	return ret;
 }
 
+/* Collect the regular files under "dir" whose name matches "pattern",
+ * in a stable order. Symbolic links to directories are not followed. */
+static int
+collect_dir_files (const char *dir, const char *pattern, char ***files,
+		   uint32_t *total)
+{
+	struct dirent **entries = NULL;
+	struct stat st;
+	char **files_new;
+	char *path;
+	int n, ret = 0;
+
+	n = scandir (dir, &entries, NULL, alphasort);
+	if (n < 0) {
+		fprintf (stderr, "Failed to read directory %s: %m\n", dir);
+		return -1;
+	}
+
+	for (int i = 0; i < n; i++) {
+		const char *name = entries[i]->d_name;
+
+		if (ret < 0 || strcmp (name, ".") == 0 || strcmp (name, "..") == 0)
+			goto next;
+
+		path = malloc (strlen (dir) + strlen (name) + 2);
+		if (!path) {
+			fprintf (stderr, "Could not allocate space: %m\n");
+			ret = -1;
+			goto next;
+		}
+		sprintf (path, "%s/%s", dir, name);
+
+		if (lstat (path, &st) < 0) {
+			fprintf (stderr, "Failed to get file status, %s\n", path);
+			free (path);
+			ret = -1;
+			goto next;
+		}
+
+		if (S_ISDIR(st.st_mode)) {
+			ret = collect_dir_files (path, pattern, files, total);
+			free (path);
+			goto next;
+		}
+
+		if ((S_ISLNK(st.st_mode) && (stat (path, &st) < 0 ||
+					     !S_ISREG(st.st_mode))) ||
+		    (!S_ISLNK(st.st_mode) && !S_ISREG(st.st_mode)) ||
+		    (pattern && fnmatch (pattern, name, 0) != 0)) {
+			free (path);
+			goto next;
+		}
+
+		files_new = realloc (*files, (*total + 1) * sizeof(char *));
+		if (!files_new) {
+			fprintf (stderr, "Could not allocate space: %m\n");
+			free (path);
+			ret = -1;
+			goto next;
+		}
+		*files = files_new;
+		(*files)[(*total)++] = path;
+next:
+		free (entries[i]);
+	}
+	free (entries);
+
+	return ret;
+}
+
+/* The signature lists of an authenticated variable payload (.auth) follow
+ * the EFI_VARIABLE_AUTHENTICATION_2 descriptor. Return their offset, or 0
+ * for plain signature lists. */
+static size_t
+auth2_header_size (const uint8_t *data, size_t data_size)
+{
+	const EFI_VARIABLE_AUTHENTICATION_2 *auth = (const void *)data;
+	size_t size;
+
+	if (data_size < sizeof(EFI_TIME) + offsetof(WIN_CERTIFICATE_UEFI_GUID, CertData))
+		return 0;
+
+	if (auth->AuthInfo.Hdr.wRevision != WIN_CERT_REVISION_2_0 ||
+	    auth->AuthInfo.Hdr.wCertificateType != WIN_CERT_TYPE_EFI_GUID ||
+	    efi_guid_cmp (&auth->AuthInfo.CertType, &efi_guid_pkcs7_cert) != 0)
+		return 0;
+
+	size = sizeof(EFI_TIME) + auth->AuthInfo.Hdr.dwLength;
+	if (auth->AuthInfo.Hdr.dwLength < offsetof(WIN_CERTIFICATE_UEFI_GUID, CertData) ||
+	    size > data_size)
+		return 0;
+
+	return size;
+}
+
+/* Certificates and the hash types MokManager can enroll. The hashes of
+ * a TBSCertificate only revoke, so they are only taken into MokXNew. */
+static int
+is_supported_list (const EFI_SIGNATURE_LIST *CertList, MokRequest req)
+{
+	uint32_t data_size = CertList->SignatureSize - sizeof(efi_guid_t);
+	uint32_t tbs_size;
+
+	if (efi_guid_cmp (&CertList->SignatureType, &efi_guid_x509_cert) == 0)
+		return 1;
+
+	/* the hash is followed by the EFI_TIME of the revocation */
+	tbs_size = tbs_hash_size (&CertList->SignatureType);
+	if (tbs_size)
+		return req == ENROLL_BLACKLIST &&
+		       data_size == tbs_size + sizeof(EFI_TIME);
+
+	return data_size == efi_hash_size (&CertList->SignatureType);
+}
+
+/* Add the entries of signature lists (.esl) or an authenticated variable
+ * payload (.auth) to MokNew or MokXNew. The lists are copied as they are,
+ * only dropping the entries that are already enrolled or requested. */
+static int
+import_esl (const char *file, MokRequest req, const char *hash_file,
+	    const int root_pw)
+{
+	uint8_t *data = NULL;
+	size_t data_size;
+	uint8_t *esl;
+	size_t esl_size;
+	uint8_t *old_req_data = NULL;
+	size_t old_req_data_size = 0;
+	uint8_t *new_list = NULL;
+	size_t real_size = 0;
+	RequestSnapshot snap;
+	EFI_SIGNATURE_LIST *CertList = NULL;
+	unsigned int entry = 0, entry_num = 0;
+	int *checks = NULL;
+	DeleteTarget *pending = NULL;
+	unsigned int pending_num = 0, p = 0;
+	int corrupted;
+	int fd;
+	int ret = -1;
+	const char *req_name = req == ENROLL_MOK ? "MokNew" : "MokXNew";
+	const char *reverse_req_name = req == ENROLL_MOK ? "MokDel" : "MokXDel";
+
+	fd = open (file, O_RDONLY);
+	if (fd < 0) {
+		fprintf (stderr, "Failed to open %s: %m\n", file);
+		return -1;
+	}
+	if (read_file (fd, (void **)&data, &data_size) < 0) {
+		fprintf (stderr, "Failed to read %s: %m\n", file);
+		close (fd);
+		return -1;
+	}
+	close (fd);
+
+	esl = data + auth2_header_size (data, data_size);
+	esl_size = data_size - (esl - data);
+
+	while ((CertList = next_signature_list (esl, esl_size, CertList,
+						&corrupted)))
+		entry_num += signature_count (CertList);
+	if (corrupted || esl_size == 0) {
+		fprintf (stderr, "Abort!!! %s is not a valid signature list\n",
+			 file);
+		free (data);
+		return -1;
+	}
+
+	if (load_request_snapshot (req, &snap) < 0)
+		goto error;
+	for (unsigned int i = 0; i < snap.num; i++) {
+		if (snap.vars[i].err && snap.vars[i].err != ENOENT) {
+			errno = snap.vars[i].err;
+			fprintf (stderr, "Failed to read variable \"%s\": %m\n",
+				 snap.vars[i].name);
+			goto error;
+		}
+		if (strcmp (snap.vars[i].name, req_name) == 0) {
+			old_req_data = snap.vars[i].data;
+			old_req_data_size = snap.vars[i].size;
+		}
+	}
+
+	/* The new lists can only shrink */
+	new_list = malloc (esl_size + old_req_data_size);
+	checks = calloc (entry_num + 1, sizeof(int));
+	pending = calloc (entry_num + 1, sizeof(DeleteTarget));
+	if (!new_list || !checks || !pending) {
+		fprintf (stderr, "Failed to allocate space for %s\n", req_name);
+		goto error;
+	}
+
+	/* Check every entry, and take the ones that can't be added out of
+	 * the reverse request with a single write */
+	while ((CertList = next_signature_list (esl, esl_size, CertList,
+						&corrupted))) {
+		uint32_t data_len = CertList->SignatureSize - sizeof(efi_guid_t);
+
+		if (!is_supported_list (CertList, req)) {
+			entry += signature_count (CertList);
+			continue;
+		}
+
+		for (uint32_t i = 0; i < signature_count (CertList); i++) {
+			EFI_SIGNATURE_DATA *Sig = signature_at (CertList, i);
+
+			/* MokManager couldn't parse it from the request */
+			if (efi_guid_cmp (&CertList->SignatureType,
+					  &efi_guid_x509_cert) == 0 &&
+			    !is_valid_cert (Sig->SignatureData, data_len)) {
+				fprintf (stderr, "Abort!!! %s (entry %u) is not a valid x509 certificate\n",
+					 file, entry + 1);
+				goto error;
+			}
+
+			checks[entry] = check_request (&snap, &CertList->SignatureType,
+						       Sig->SignatureData, data_len);
+			if (checks[entry] >= 0) {
+				pending[pending_num].type = &CertList->SignatureType;
+				pending[pending_num].data = Sig->SignatureData;
+				pending[pending_num].size = data_len;
+				pending_num++;
+			}
+			entry++;
+		}
+	}
+	in_pending_requests (pending, pending_num, req);
+
+	entry = 0;
+	while ((CertList = next_signature_list (esl, esl_size, CertList,
+						&corrupted))) {
+		EFI_SIGNATURE_LIST *NewList = (void *)(new_list + real_size);
+		uint32_t head_size = sizeof(EFI_SIGNATURE_LIST) +
+				     CertList->SignatureHeaderSize;
+		uint32_t sig_num = signature_count (CertList);
+		uint32_t kept = 0;
+		uint8_t *ptr;
+		int type, check;
+
+		type = signature_type_index (&CertList->SignatureType);
+		if (!is_supported_list (CertList, req)) {
+			if (sig_num == 1)
+				printf ("SKIP: %s (entry %u) has an unsupported signature type\n",
+					file, entry + 1);
+			else
+				printf ("SKIP: %s (entries %u to %u) have an unsupported signature type\n",
+					file, entry + 1, entry + sig_num);
+			entry += sig_num;
+			continue;
+		}
+
+		memcpy (NewList, CertList, head_size);
+		ptr = (uint8_t *)NewList + head_size;
+
+		for (uint32_t i = 0; i < sig_num; i++) {
+			EFI_SIGNATURE_DATA *Sig = signature_at (CertList, i);
+
+			check = checks[entry++];
+			if (check < 0) {
+				memcpy (ptr, Sig, CertList->SignatureSize);
+				ptr += CertList->SignatureSize;
+				kept++;
+			} else if (pending[p++].removed) {
+				printf ("Removed %s (%s entry %u) from %s\n", file,
+					sig_types[type].name, entry,
+					reverse_req_name);
+			} else {
+				printf ("SKIP: %s (%s entry %u) %s\n", file,
+					sig_types[type].name, entry,
+					snap.checks[check]->skip_message);
+			}
+		}
+
+		if (kept == 0)
+			continue;
+
+		NewList->SignatureListSize = head_size +
+					     kept * CertList->SignatureSize;
+		real_size += NewList->SignatureListSize;
+	}
+
+	/* All entries are in the list, nothing to do here... */
+	if (real_size == 0) {
+		ret = 0;
+		goto error;
+	}
+
+	/* append the keys to the previous request */
+	if (old_req_data && old_req_data_size) {
+		memcpy (new_list + real_size, old_req_data, old_req_data_size);
+		real_size += old_req_data_size;
+	}
+
+	if (update_request (new_list, real_size, req, hash_file, root_pw) < 0)
+		goto error;
+
+	ret = 0;
+error:
+	free_request_snapshot (&snap);
+	free (pending);
+	free (checks);
+	free (new_list);
+	free (data);
+
+	return ret;
+}
+
+/* The value of every hex digit plus one, 0 for anything else */
+static const uint8_t hex_table[256] = {
+	['0'] = 1,  ['1'] = 2,  ['2'] = 3,  ['3'] = 4,  ['4'] = 5,
+	['5'] = 6,  ['6'] = 7,  ['7'] = 8,  ['8'] = 9,  ['9'] = 10,
+	['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+	['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+
 static int
 identify_hash_type (const char *hash_str, efi_guid_t *type)
 {
@@ -1371,10 +3504,8 @@ identify_hash_type (const char *hash_str, efi_guid_t *type)
 	int hash_size;
 
 	for (unsigned int i = 0; i < len; i++) {
-		if ((hash_str[i] > '9' || hash_str[i] < '0') &&
-		    (hash_str[i] > 'f' || hash_str[i] < 'a') &&
-		    (hash_str[i] > 'F' || hash_str[i] < 'A'))
-		return -1;
+		if (!hex_table[(uint8_t)hash_str[i]])
+			return -1;
 	}
 
 	switch (len) {
@@ -1407,18 +3538,21 @@ identify_hash_type (const char *hash_str, efi_guid_t *type)
 	return hash_size;
 }
 
+/* Decode len bytes from hex_str, which must hold 2 * len hex digits */
 static int
 hex_str_to_binary (const char *hex_str, uint8_t *array, unsigned int len)
 {
-	char *pos;
+	uint8_t hi, lo;
 
 	if (!hex_str || !array)
 		return -1;
 
-	pos = (char *)hex_str;
 	for (unsigned int i = 0; i < len; i++) {
-		sscanf (pos, "%2hhx", &array[i]);
-		pos += 2;
+		hi = hex_table[(uint8_t)hex_str[2 * i]];
+		lo = hex_table[(uint8_t)hex_str[2 * i + 1]];
+		if (!hi || !lo)
+			return -1;
+		array[i] = (hi - 1) << 4 | (lo - 1);
 	}
 
 	return 0;
@@ -1593,13 +3727,474 @@ error:
 	return ret;
 }
 
+/* A hash to add to a request, from a line of a list or from a file */
+typedef struct HashEntry {
+	efi_guid_t              type;
+	uint32_t                size;
+	uint8_t                 hash[SHA512_DIGEST_LENGTH];
+	const char             *name;
+	unsigned int            line;
+	int                     check;
+	const struct HashEntry *same;
+} HashEntry;
+
 static int
-revoke_request (MokRequest req)
+cmp_hash_entry (const void *a, const void *b)
 {
-	switch (req) {
-	case ENROLL_MOK:
-		if (test_and_delete_var ("MokNew") < 0)
-			return -1;
+	const HashEntry *x = *(const HashEntry **)a;
+	const HashEntry *y = *(const HashEntry **)b;
+	int ret;
+
+	if (x->size != y->size)
+		return x->size < y->size ? -1 : 1;
+
+	ret = memcmp (x->hash, y->hash, x->size);
+	if (ret)
+		return ret;
+
+	/* Keep the first occurrence first */
+	return x->line < y->line ? -1 : x->line > y->line;
+}
+
+/* Parse a list of hashes, one per line. Only the first word of a line
+ * is used, so the output of sha256sum and friends works as well. Blank
+ * lines and lines starting with '#' are ignored. */
+static int
+parse_hash_list (const char *file, const char *data, size_t size,
+		 HashEntry **entries, unsigned int *num)
+{
+	HashEntry *list = NULL, *list_new;
+	char token[SHA512_DIGEST_LENGTH * 2 + 1];
+	unsigned int count = 0, alloced = 0, line = 0;
+	size_t pos = 0, start, len;
+	int hash_size;
+
+	while (pos < size) {
+		line++;
+
+		while (pos < size && data[pos] != '\n' &&
+		       isspace ((unsigned char)data[pos]))
+			pos++;
+		start = pos;
+		while (pos < size && !isspace ((unsigned char)data[pos]))
+			pos++;
+		len = pos - start;
+		while (pos < size && data[pos++] != '\n')
+			;
+
+		if (len == 0 || data[start] == '#')
+			continue;
+
+		if (len >= sizeof(token))
+			goto invalid;
+		memcpy (token, data + start, len);
+		token[len] = '\0';
+
+		if (count == alloced) {
+			alloced = alloced ? alloced * 2 : 64;
+			list_new = realloc (list, alloced * sizeof(HashEntry));
+			if (!list_new) {
+				fprintf (stderr, "Failed to allocate space: %m\n");
+				free (list);
+				return -1;
+			}
+			list = list_new;
+		}
+
+		hash_size = identify_hash_type (token, &list[count].type);
+		if (hash_size < 0 ||
+		    hex_str_to_binary (token, list[count].hash, hash_size) < 0)
+			goto invalid;
+
+		list[count].size = hash_size;
+		list[count].name = NULL;
+		list[count].line = line;
+		list[count].check = -1;
+		list[count].same = NULL;
+		count++;
+	}
+
+	*entries = list;
+	*num = count;
+
+	return 0;
+invalid:
+	fprintf (stderr, "Invalid hash on line %u of %s\n", line, file);
+	free (list);
+	return -1;
+}
+
+/* Append the new hashes of the given type as signature data */
+static uint8_t *
+append_new_hashes (uint8_t *ptr, const HashEntry *entries, unsigned int num,
+		   int type)
+{
+	EFI_SIGNATURE_DATA *CertData;
+
+	for (unsigned int i = 0; i < num; i++) {
+		if (entries[i].same || entries[i].check >= 0 ||
+		    signature_type_index (&entries[i].type) != type)
+			continue;
+		CertData = (EFI_SIGNATURE_DATA *)ptr;
+		CertData->SignatureOwner = efi_guid_shim;
+		memcpy (CertData->SignatureData, entries[i].hash,
+			entries[i].size);
+		ptr += sizeof(efi_guid_t) + entries[i].size;
+	}
+
+	return ptr;
+}
+
+/* A list in the request the new hashes of its type can be appended to */
+static int
+is_hash_list (const EFI_SIGNATURE_LIST *CertList)
+{
+	return CertList->SignatureHeaderSize == 0 &&
+	       CertList->SignatureSize == signature_size (&CertList->SignatureType);
+}
+
+/* Name a hash in the messages */
+static const char *
+hash_label (char *buf, size_t size, const HashEntry *entry)
+{
+	if (entry->name)
+		return entry->name;
+
+	snprintf (buf, size, "hash on line %u", entry->line);
+
+	return buf;
+}
+
+/* Add or remove the hashes with a single request write. The new hashes
+ * are appended to the first list of the same type in the request, or
+ * put in a new list in front of it. */
+static int
+issue_hash_entries (HashEntry *entries, unsigned int num, MokRequest req,
+		    const char *hash_file, const int root_pw)
+{
+	HashEntry **sorted = NULL;
+	DeleteTarget *pending = NULL;
+	unsigned int pending_num = 0, p = 0;
+	RequestSnapshot snap;
+	uint8_t *old_req_data = NULL;
+	size_t old_req_data_size = 0;
+	EFI_SIGNATURE_LIST *CertList = NULL;
+	EFI_SIGNATURE_LIST *NewList;
+	uint8_t *new_list = NULL;
+	uint8_t *ptr;
+	uint32_t kept[SIG_TYPE_NUM] = {0};
+	int merged[SIG_TYPE_NUM] = {0};
+	unsigned int kept_total = 0;
+	int corrupted = 0;
+	int type;
+	int ret = -1;
+	const char *req_names[] = {
+		[DELETE_MOK] = "MokDel",
+		[ENROLL_MOK] = "MokNew",
+		[DELETE_BLACKLIST] = "MokXDel",
+		[ENROLL_BLACKLIST] = "MokXNew"
+	};
+	const char *reverse_req_names[] = {
+		[DELETE_MOK] = "MokNew",
+		[ENROLL_MOK] = "MokDel",
+		[DELETE_BLACKLIST] = "MokXNew",
+		[ENROLL_BLACKLIST] = "MokXDel"
+	};
+
+	/* Sort a copy to spot the hashes listed more than once */
+	sorted = malloc (num * sizeof(HashEntry *));
+	if (!sorted) {
+		fprintf (stderr, "Failed to allocate space: %m\n");
+		return -1;
+	}
+	for (unsigned int i = 0; i < num; i++)
+		sorted[i] = &entries[i];
+	qsort (sorted, num, sizeof(HashEntry *), cmp_hash_entry);
+	for (unsigned int i = 1; i < num; i++) {
+		if (sorted[i]->size == sorted[i - 1]->size &&
+		    memcmp (sorted[i]->hash, sorted[i - 1]->hash,
+			    sorted[i]->size) == 0)
+			sorted[i]->same = sorted[i - 1]->same ?
+					  sorted[i - 1]->same : sorted[i - 1];
+	}
+	free (sorted);
+
+	if (load_request_snapshot (req, &snap) < 0)
+		goto error;
+	for (unsigned int i = 0; i < snap.num; i++) {
+		if (snap.vars[i].err && snap.vars[i].err != ENOENT) {
+			errno = snap.vars[i].err;
+			fprintf (stderr, "Failed to read variable \"%s\": %m\n",
+				 snap.vars[i].name);
+			goto error;
+		}
+		if (strcmp (snap.vars[i].name, req_names[req]) == 0) {
+			old_req_data = snap.vars[i].data;
+			old_req_data_size = snap.vars[i].size;
+		}
+	}
+
+	pending = calloc (num, sizeof(DeleteTarget));
+	if (!pending) {
+		fprintf (stderr, "Failed to allocate space: %m\n");
+		goto error;
+	}
+
+	/* Take the hashes that can't be added out of the reverse request
+	 * with a single write */
+	for (unsigned int i = 0; i < num; i++) {
+		HashEntry *entry = &entries[i];
+
+		if (entry->same)
+			continue;
+
+		entry->check = check_request (&snap, &entry->type, entry->hash,
+					      entry->size);
+		if (entry->check >= 0) {
+			pending[pending_num].type = &entry->type;
+			pending[pending_num].data = entry->hash;
+			pending[pending_num].size = entry->size;
+			pending_num++;
+		}
+	}
+	in_pending_requests (pending, pending_num, req);
+
+	for (unsigned int i = 0; i < num; i++) {
+		HashEntry *entry = &entries[i];
+		char buf[32], same_buf[32];
+		const char *label = hash_label (buf, sizeof(buf), entry);
+
+		if (entry->same && (!entry->name ||
+				    strcmp (entry->name, entry->same->name) == 0)) {
+			printf ("SKIP: %s is listed more than once\n", label);
+			continue;
+		} else if (entry->same) {
+			printf ("SKIP: %s has the same hash as %s\n", label,
+				hash_label (same_buf, sizeof(same_buf),
+					    entry->same));
+			continue;
+		}
+
+		if (entry->check < 0) {
+			kept[signature_type_index (&entry->type)]++;
+			kept_total++;
+		} else if (pending[p++].removed) {
+			printf ("Removed %s from %s\n", label,
+				reverse_req_names[req]);
+		} else {
+			printf ("SKIP: %s %s\n", label,
+				snap.checks[entry->check]->skip_message);
+		}
+	}
+
+	/* All hashes are in the list, nothing to do here... */
+	if (kept_total == 0) {
+		ret = 0;
+		goto error;
+	}
+
+	/* Pick the lists of the request the new hashes go to */
+	while ((CertList = next_signature_list (old_req_data, old_req_data_size,
+						CertList, &corrupted))) {
+		type = signature_type_index (&CertList->SignatureType);
+		if (type >= 0 && kept[type] && is_hash_list (CertList))
+			merged[type] = 1;
+	}
+	if (corrupted) {
+		fprintf (stderr, "Corrupted signature list in %s\n",
+			 req_names[req]);
+		goto error;
+	}
+
+	new_list = malloc (old_req_data_size +
+			   SIG_TYPE_NUM * sizeof(EFI_SIGNATURE_LIST) +
+			   kept_total * (sizeof(efi_guid_t) + SHA512_DIGEST_LENGTH));
+	if (!new_list) {
+		fprintf (stderr, "Failed to allocate space for %s: %m\n",
+			 req_names[req]);
+		goto error;
+	}
+	ptr = new_list;
+
+	/* The hash types without such a list get a new one */
+	for (type = 0; type < (int)SIG_TYPE_NUM; type++) {
+		if (!kept[type] || merged[type])
+			continue;
+
+		NewList = (EFI_SIGNATURE_LIST *)ptr;
+		NewList->SignatureType = *sig_types[type].guid;
+		NewList->SignatureHeaderSize = 0;
+		NewList->SignatureSize = signature_size (sig_types[type].guid);
+		NewList->SignatureListSize = sizeof(EFI_SIGNATURE_LIST) +
+					     kept[type] * NewList->SignatureSize;
+		ptr = append_new_hashes (ptr + sizeof(EFI_SIGNATURE_LIST),
+					 entries, num, type);
+	}
+
+	/* Copy the old request and extend the first list of each type */
+	CertList = NULL;
+	while ((CertList = next_signature_list (old_req_data, old_req_data_size,
+						CertList, &corrupted))) {
+		NewList = (EFI_SIGNATURE_LIST *)ptr;
+		memcpy (ptr, CertList, CertList->SignatureListSize);
+		ptr += CertList->SignatureListSize;
+
+		type = signature_type_index (&CertList->SignatureType);
+		if (type < 0 || merged[type] != 1 || !is_hash_list (CertList))
+			continue;
+		merged[type] = 2;
+
+		NewList->SignatureListSize += kept[type] * NewList->SignatureSize;
+		ptr = append_new_hashes (ptr, entries, num, type);
+	}
+
+	if (update_request (new_list, ptr - new_list, req, hash_file,
+			    root_pw) < 0)
+		goto error;
+
+	ret = 0;
+error:
+	free_request_snapshot (&snap);
+	if (pending)
+		free (pending);
+	if (new_list)
+		free (new_list);
+
+	return ret;
+}
+
+/* Add or remove every hash listed in a file */
+static int
+issue_hashes_request (const char *file, MokRequest req,
+		      const char *hash_file, const int root_pw)
+{
+	char *data = NULL;
+	size_t data_size;
+	HashEntry *entries = NULL;
+	unsigned int num = 0;
+	int fd = STDIN_FILENO;
+	int ret;
+
+	if (strcmp (file, "-") == 0) {
+		/* The password prompt would read from the same stdin */
+		if (!hash_file && !root_pw) {
+			fprintf (stderr, "Reading the hashes from stdin requires --hash-file or --root-pw\n");
+			return -1;
+		}
+	} else {
+		fd = open (file, O_RDONLY);
+		if (fd < 0) {
+			fprintf (stderr, "Failed to open %s: %m\n", file);
+			return -1;
+		}
+	}
+
+	ret = read_file (fd, (void **)&data, &data_size);
+	if (fd != STDIN_FILENO)
+		close (fd);
+	if (ret < 0) {
+		fprintf (stderr, "Failed to read %s: %m\n", file);
+		return -1;
+	}
+
+	ret = parse_hash_list (file, data, data_size, &entries, &num);
+	free (data);
+	if (ret < 0)
+		return -1;
+
+	if (num == 0) {
+		fprintf (stderr, "No hash found in %s\n", file);
+		free (entries);
+		return -1;
+	}
+
+	ret = issue_hash_entries (entries, num, req, hash_file, root_pw);
+	free (entries);
+
+	return ret;
+}
+
+typedef struct {
+	char      **files;
+	HashEntry  *entries;
+	int        *errs;
+} BinaryHash;
+
+/* Compute the Authenticode SHA-256 of one image */
+static void
+hash_binary (void *ctx, unsigned int index)
+{
+	BinaryHash *bh = ctx;
+	HashEntry *entry = &bh->entries[index];
+	pe_image_t image;
+	unsigned int size;
+
+	if (pe_image_open (&image, bh->files[index]) < 0) {
+		bh->errs[index] = errno;
+		return;
+	}
+
+	if (pe_image_digest (&image, EVP_sha256 (), entry->hash, &size) < 0)
+		bh->errs[index] = errno ? errno : EIO;
+
+	pe_image_close (&image);
+}
+
+/* Enroll or blacklist EFI binaries by their Authenticode hash */
+static int
+issue_binary_request (char **files, uint32_t total, MokRequest req,
+		      const char *hash_file, const int root_pw)
+{
+	BinaryHash bh;
+	int ret = -1;
+
+	if (!files)
+		return -1;
+
+	bh.files = files;
+	bh.entries = calloc (total, sizeof(HashEntry));
+	bh.errs = calloc (total, sizeof(int));
+	if (!bh.entries || !bh.errs) {
+		fprintf (stderr, "Failed to allocate space: %m\n");
+		goto error;
+	}
+
+	run_parallel (total, hash_binary, NULL, &bh);
+
+	for (unsigned int i = 0; i < total; i++) {
+		if (bh.errs[i]) {
+			errno = bh.errs[i];
+			if (errno == ENOEXEC)
+				fprintf (stderr, "Abort!!! %s is not a valid PE/COFF image\n",
+					 files[i]);
+			else
+				fprintf (stderr, "Failed to read %s: %m\n", files[i]);
+			goto error;
+		}
+
+		bh.entries[i].type = efi_guid_sha256;
+		bh.entries[i].size = SHA256_DIGEST_LENGTH;
+		bh.entries[i].name = files[i];
+		bh.entries[i].line = i + 1;
+		bh.entries[i].check = -1;
+		bh.entries[i].same = NULL;
+	}
+
+	ret = issue_hash_entries (bh.entries, total, req, hash_file, root_pw);
+error:
+	free (bh.entries);
+	free (bh.errs);
+
+	return ret;
+}
+
+static int
+revoke_request (MokRequest req)
+{
+	switch (req) {
+	case ENROLL_MOK:
+		if (test_and_delete_var ("MokNew") < 0)
+			return -1;
 		if (test_and_delete_var ("MokAuth") < 0)
 			return -1;
 		break;
@@ -1684,7 +4279,7 @@ export_db_keys (const DBName db_name)
 
 		/* Dump X509 certificate to files */
 		snprintf (filename, PATH_MAX, "%s-%04d.der", db_friendly_name[db_name], i+1);
-		fd = open (filename, O_CREAT | O_WRONLY, mode);
+		fd = open (filename, O_CREAT | O_WRONLY | O_TRUNC, mode);
 		if (fd < 0) {
 			fprintf (stderr, "Failed to open %s: %m\n", filename);
 			goto error;
@@ -1713,53 +4308,570 @@ error:
 	return ret;
 }
 
+typedef struct {
+	MokListNode *list;
+	uint32_t    *certs;
+	int          dirfd;
+	int         *result;
+} DirExport;
+
 static int
-set_password (const char *hash_file, const int root_pw, const int clear)
+cmp_mok_node (const void *a, const void *b)
 {
-	uint8_t *data;
-	size_t data_size;
-	pw_crypt_t pw_crypt;
-	uint8_t auth[SHA256_DIGEST_LENGTH];
-	char *password = NULL;
-	unsigned int pw_len;
-	int auth_ret;
-	int ret = -1;
+	const MokListNode *x = *(const MokListNode **)a;
+	const MokListNode *y = *(const MokListNode **)b;
 
-	memset (&pw_crypt, 0, sizeof(pw_crypt_t));
-	memset (auth, 0, SHA256_DIGEST_LENGTH);
+	if (x->mok_size != y->mok_size)
+		return x->mok_size < y->mok_size ? -1 : 1;
 
-	if (hash_file) {
-		if (get_hash_from_file (hash_file, &pw_crypt) < 0) {
-			fprintf (stderr, "Failed to read hash\n");
-			goto error;
-		}
-	} else if (root_pw) {
-		if (get_password_from_shadow (&pw_crypt) < 0) {
-			fprintf (stderr, "Failed to get root password hash\n");
-			goto error;
-		}
-	} else if (!clear) {
-		if (get_password (&password, &pw_len, PASSWORD_MIN, PASSWORD_MAX) < 0) {
-			fprintf (stderr, "Abort\n");
-			goto error;
-		}
+	return memcmp (x->mok, y->mok, x->mok_size);
+}
 
-		if (!use_simple_hash) {
-			pw_crypt.method = DEFAULT_CRYPT_METHOD;
-			auth_ret = generate_hash (&pw_crypt, password, pw_len);
-		} else {
-			auth_ret = generate_auth (NULL, 0, password, pw_len,
-						  auth);
-		}
-		if (auth_ret < 0) {
-			fprintf (stderr, "Couldn't generate hash\n");
-			goto error;
+static int
+cmp_uint32 (const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Keep only the first of the certificates listed more than once, as they
+ * go to the same file. Returns the number of certificates left. */
+static uint32_t
+drop_repeated_certs (MokListNode *list, uint32_t *certs, uint32_t num)
+{
+	const MokListNode **sorted;
+	uint32_t kept = 0;
+
+	if (num < 2)
+		return num;
+
+	sorted = malloc (num * sizeof(MokListNode *));
+	if (!sorted)
+		return num;
+
+	for (uint32_t i = 0; i < num; i++)
+		sorted[i] = &list[certs[i]];
+	qsort (sorted, num, sizeof(MokListNode *), cmp_mok_node);
+
+	/* Equal nodes keep the lowest index, so the first copy stays */
+	for (uint32_t i = 0, j; i < num; i = j) {
+		const MokListNode *first = sorted[i];
+
+		for (j = i + 1; j < num && cmp_mok_node (&sorted[i],
+							 &sorted[j]) == 0; j++) {
+			if (sorted[j] < first)
+				first = sorted[j];
 		}
+		certs[kept++] = first - list;
 	}
+	free (sorted);
 
-	if (!use_simple_hash) {
-		data = (void *)&pw_crypt;
-		data_size = PASSWORD_CRYPT_SIZE;
+	qsort (certs, kept, sizeof(uint32_t), cmp_uint32);
+
+	return kept;
+}
+
+/* Write one certificate as <sha256>.der unless it's already there. The
+ * data goes to a temporary file that is synced before the rename, so an
+ * interrupted export or a crash never leaves a truncated file behind.
+ * A file of the wrong size is rewritten anyway. */
+static void
+export_key_to_dir (void *ctx, unsigned int index)
+{
+	DirExport *ex = ctx;
+	MokListNode *node = &ex->list[ex->certs[index]];
+	uint8_t digest[SHA256_DIGEST_LENGTH];
+	char name[SHA256_DIGEST_LENGTH * 2 + sizeof(".der")];
+	char tmp_name[sizeof(name) + 32];
+	struct stat st;
+	size_t offset = 0;
+	ssize_t write_size;
+	size_t len;
+	int fd;
+
+	EVP_Digest (node->mok, node->mok_size, digest, NULL, EVP_sha256 (),
+		    NULL);
+	len = hex_encode (name, digest, SHA256_DIGEST_LENGTH, '\0');
+	memcpy (name + len, ".der", sizeof(".der"));
+
+	if (fstatat (ex->dirfd, name, &st, 0) == 0 && S_ISREG (st.st_mode) &&
+	    st.st_size == (off_t)node->mok_size) {
+		ex->result[index] = 0;
+		return;
+	}
+
+	ex->result[index] = -1;
+
+	/* The index keeps the name unique when the database holds the same
+	 * certificate twice. A file already there was left behind by a run
+	 * that died with the same PID, so it can go. */
+	snprintf (tmp_name, sizeof(tmp_name), ".%.16s.%d.%u", name,
+		  (int)getpid (), index);
+	fd = openat (ex->dirfd, tmp_name, O_CREAT | O_EXCL | O_WRONLY,
+		     S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fd < 0 && errno == EEXIST && unlinkat (ex->dirfd, tmp_name, 0) == 0)
+		fd = openat (ex->dirfd, tmp_name, O_CREAT | O_EXCL | O_WRONLY,
+			     S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	if (fd < 0) {
+		fprintf (stderr, "Failed to open %s: %m\n", tmp_name);
+		return;
+	}
+
+	while (offset < node->mok_size) {
+		write_size = write (fd, node->mok + offset,
+				    node->mok_size - offset);
+		if (write_size < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf (stderr, "Failed to write %s: %m\n", name);
+			close (fd);
+			goto error;
+		}
+		offset += write_size;
+	}
+
+	if (fsync (fd) < 0) {
+		fprintf (stderr, "Failed to sync %s: %m\n", name);
+		close (fd);
+		goto error;
+	}
+
+	if (close (fd) < 0) {
+		fprintf (stderr, "Failed to write %s: %m\n", name);
+		goto error;
+	}
+
+	if (renameat (ex->dirfd, tmp_name, ex->dirfd, name) < 0) {
+		fprintf (stderr, "Failed to rename %s: %m\n", tmp_name);
+		goto error;
+	}
+
+	ex->result[index] = 1;
+	return;
+error:
+	unlinkat (ex->dirfd, tmp_name, 0);
+}
+
+/* Export the certificates of the database into a directory, named by
+ * the SHA-256 of their content so that repeated exports only write the
+ * keys that are new */
+static int
+export_db_dir (const DBName db_name, const char *dir)
+{
+	uint8_t *data = NULL;
+	size_t data_size = 0;
+	uint32_t attributes;
+	uint32_t mok_num, cert_num = 0;
+	MokListNode *list = NULL;
+	DirExport ex;
+	unsigned int written = 0, unchanged = 0, failed = 0;
+	int ret = -1;
+
+	ex.dirfd = -1;
+	ex.certs = NULL;
+	ex.result = NULL;
+
+	if (efi_get_variable (*db_var_guid[db_name], db_var_name[db_name],
+			      &data, &data_size, &attributes) < 0) {
+		if (errno == ENOENT) {
+			printf ("%s is empty\n", db_var_name[db_name]);
+			return 0;
+		}
+
+		fprintf (stderr, "Failed to read %s: %m\n", db_var_name[db_name]);
+		return -1;
+	}
+
+	list = build_mok_list (data, data_size, &mok_num);
+	if (list == NULL)
+		goto error;
+
+	ex.certs = malloc (mok_num * sizeof(uint32_t));
+	ex.result = calloc (mok_num, sizeof(int));
+	if (!ex.certs || !ex.result) {
+		fprintf (stderr, "Failed to allocate buffer: %m\n");
+		goto error;
+	}
+
+	for (uint32_t i = 0; i < mok_num; i++) {
+		if (efi_guid_cmp (&list[i].header->SignatureType,
+				  &efi_guid_x509_cert) == 0)
+			ex.certs[cert_num++] = i;
+	}
+	cert_num = drop_repeated_certs (list, ex.certs, cert_num);
+
+	if (mkdir (dir, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) < 0 &&
+	    errno != EEXIST) {
+		fprintf (stderr, "Failed to create %s: %m\n", dir);
+		goto error;
+	}
+
+	ex.dirfd = open (dir, O_RDONLY | O_DIRECTORY);
+	if (ex.dirfd < 0) {
+		fprintf (stderr, "Failed to open %s: %m\n", dir);
+		goto error;
+	}
+	ex.list = list;
+
+	run_parallel (cert_num, export_key_to_dir, NULL, &ex);
+
+	for (uint32_t i = 0; i < cert_num; i++) {
+		if (ex.result[i] > 0)
+			written++;
+		else if (ex.result[i] == 0)
+			unchanged++;
+		else
+			failed++;
+	}
+
+	/* Make the renames durable as well */
+	if (written > 0 && fsync (ex.dirfd) < 0) {
+		fprintf (stderr, "Failed to sync %s: %m\n", dir);
+		failed++;
+	}
+
+	printf ("%s: %u key(s) written, %u unchanged\n", db_var_name[db_name],
+		written, unchanged);
+
+	if (failed == 0)
+		ret = 0;
+error:
+	if (ex.dirfd >= 0)
+		close (ex.dirfd);
+	free (ex.result);
+	free (ex.certs);
+	free (list);
+	free (data);
+
+	return ret;
+}
+
+#define TAR_BLOCK_SIZE 512
+
+typedef struct {
+	ArchiveFormat format;
+	time_t        mtime;
+	unsigned int  ino;
+	OutBuf        ob;
+} Archive;
+
+static void
+archive_pad (Archive *ar, size_t size, size_t align)
+{
+	static const char zero[TAR_BLOCK_SIZE];
+
+	if (size % align)
+		outbuf_put (&ar->ob, zero, align - size % align);
+}
+
+/* Append a regular file in the ustar or cpio "newc" format */
+static int
+archive_add (Archive *ar, const char *name, const void *data, size_t size)
+{
+	size_t name_len = strlen (name);
+	char header[TAR_BLOCK_SIZE];
+	unsigned int sum = 0;
+
+	switch (ar->format) {
+	case ARCHIVE_TAR:
+		if (name_len >= 100)
+			return -1;
+		memset (header, 0, sizeof(header));
+		memcpy (header, name, name_len);
+		sprintf (header + 100, "%07o", 0644);
+		sprintf (header + 108, "%07o", 0);
+		sprintf (header + 116, "%07o", 0);
+		sprintf (header + 124, "%011lo", (unsigned long)size);
+		sprintf (header + 136, "%011lo", (unsigned long)ar->mtime);
+		header[156] = '0';
+		memcpy (header + 257, "ustar", 6);
+		memcpy (header + 263, "00", 2);
+		/* The checksum is computed with its own field set to spaces */
+		memset (header + 148, ' ', 8);
+		for (unsigned int i = 0; i < sizeof(header); i++)
+			sum += (uint8_t)header[i];
+		sprintf (header + 148, "%06o", sum);
+
+		outbuf_put (&ar->ob, header, sizeof(header));
+		outbuf_write (&ar->ob, data, size);
+		archive_pad (ar, size, TAR_BLOCK_SIZE);
+		break;
+	case ARCHIVE_CPIO:
+		sprintf (header, "070701%08X%08X%08X%08X%08X%08lX%08lX"
+			 "%08X%08X%08X%08X%08lX%08X",
+			 ++ar->ino, 0100644, 0, 0, 1,
+			 (unsigned long)ar->mtime, (unsigned long)size,
+			 0, 0, 0, 0, (unsigned long)name_len + 1, 0);
+		outbuf_put (&ar->ob, header, 110);
+		outbuf_put (&ar->ob, name, name_len + 1);
+		archive_pad (ar, 110 + name_len + 1, 4);
+		outbuf_write (&ar->ob, data, size);
+		archive_pad (ar, size, 4);
+		break;
+	default:
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+archive_finish (Archive *ar)
+{
+	static const char zero[TAR_BLOCK_SIZE];
+	char header[111];
+
+	switch (ar->format) {
+	case ARCHIVE_TAR:
+		/* Two zero blocks mark the end of the archive */
+		outbuf_put (&ar->ob, zero, TAR_BLOCK_SIZE);
+		outbuf_put (&ar->ob, zero, TAR_BLOCK_SIZE);
+		break;
+	case ARCHIVE_CPIO:
+		sprintf (header, "070701%08X%08X%08X%08X%08X%08X%08X"
+			 "%08X%08X%08X%08X%08X%08X",
+			 0, 0, 0, 0, 1, 0, 0, 0, 0, 0, 0,
+			 (unsigned int)sizeof("TRAILER!!!"), 0);
+		outbuf_put (&ar->ob, header, 110);
+		outbuf_put (&ar->ob, "TRAILER!!!", sizeof("TRAILER!!!"));
+		archive_pad (ar, 110 + sizeof("TRAILER!!!"), 4);
+		break;
+	default:
+		return -1;
+	}
+
+	outbuf_flush (&ar->ob);
+	if (fflush (ar->ob.fp) != 0 || ferror (ar->ob.fp))
+		return -1;
+
+	return 0;
+}
+
+/* Add a PEM copy of a DER certificate to the archive */
+static int
+archive_add_pem (Archive *ar, const char *name, const uint8_t *cert,
+		 uint32_t cert_size)
+{
+	const unsigned char *der = cert;
+	X509 *X509cert;
+	BIO *bio;
+	char *pem;
+	long pem_size;
+	int ret = -1;
+
+	X509cert = d2i_X509 (NULL, &der, cert_size);
+	if (!X509cert)
+		return -1;
+
+	bio = BIO_new (BIO_s_mem ());
+	if (bio && PEM_write_bio_X509 (bio, X509cert)) {
+		pem_size = BIO_get_mem_data (bio, &pem);
+		ret = archive_add (ar, name, pem, pem_size);
+	}
+
+	BIO_free (bio);
+	X509_free (X509cert);
+
+	return ret;
+}
+
+/* Stream every entry of the database to stdout as a tar or cpio archive:
+ * certificates as DER and PEM, hash lists as text and a MANIFEST file
+ * describing them */
+static int
+export_db_archive (const DBName db_name, ArchiveFormat format)
+{
+	uint8_t *data = NULL;
+	size_t data_size = 0;
+	uint32_t attributes;
+	char filename[PATH_MAX];
+	uint32_t mok_num = 0;
+	MokListNode *list = NULL;
+	Archive *ar = NULL;
+	FILE *manifest = NULL;
+	char *manifest_buf = NULL;
+	size_t manifest_size = 0;
+	int ret = -1;
+
+	if (isatty (STDOUT_FILENO)) {
+		fprintf (stderr, "Refusing to write an archive to a terminal\n");
+		return -1;
+	}
+
+	if (efi_get_variable (*db_var_guid[db_name], db_var_name[db_name],
+			      &data, &data_size, &attributes) < 0) {
+		if (errno != ENOENT) {
+			fprintf (stderr, "Failed to read %s: %m\n",
+				 db_var_name[db_name]);
+			return -1;
+		}
+		/* An empty database still gets a manifest */
+		data = NULL;
+	}
+
+	if (data) {
+		list = build_mok_list (data, data_size, &mok_num);
+		if (list == NULL)
+			goto error;
+	}
+
+	ar = malloc (sizeof(Archive));
+	manifest = open_memstream (&manifest_buf, &manifest_size);
+	if (!ar || !manifest) {
+		fprintf (stderr, "Failed to allocate buffer: %m\n");
+		goto error;
+	}
+	ar->format = format;
+	ar->mtime = time (NULL);
+	ar->ino = 0;
+	ar->ob.fp = stdout;
+	ar->ob.len = 0;
+
+	fprintf (manifest, "# %s\n", db_var_name[db_name]);
+	fprintf (manifest, "# index\ttype\towner\tsha256\tfiles\n");
+
+	for (uint32_t i = 0; i < mok_num; i++) {
+		EFI_SIGNATURE_DATA *sig;
+		uint8_t fingerprint[SHA256_DIGEST_LENGTH];
+		char hex[SHA256_DIGEST_LENGTH * 2];
+		char *owner = NULL;
+		char *text = NULL;
+		size_t text_size = 0;
+		FILE *fp;
+		int type;
+
+		type = signature_type_index (&list[i].header->SignatureType);
+
+		if (efi_guid_cmp (&list[i].header->SignatureType,
+				  &efi_guid_x509_cert) == 0) {
+			sig = (EFI_SIGNATURE_DATA *)(list[i].mok - sizeof(efi_guid_t));
+			efi_guid_to_str (&sig->SignatureOwner, &owner);
+			EVP_Digest (list[i].mok, list[i].mok_size, fingerprint,
+				    NULL, EVP_sha256 (), NULL);
+			hex_encode (hex, fingerprint, SHA256_DIGEST_LENGTH, '\0');
+
+			snprintf (filename, PATH_MAX, "%s-%04u.der",
+				  db_friendly_name[db_name], i + 1);
+			if (archive_add (ar, filename, list[i].mok,
+					 list[i].mok_size) < 0)
+				goto entry_error;
+			fprintf (manifest, "%u\tx509\t%s\t%.*s\t%s", i + 1,
+				 owner ? owner : "-", (int)sizeof(hex), hex,
+				 filename);
+
+			snprintf (filename, PATH_MAX, "%s-%04u.pem",
+				  db_friendly_name[db_name], i + 1);
+			if (archive_add_pem (ar, filename, list[i].mok,
+					     list[i].mok_size) == 0)
+				fprintf (manifest, " %s", filename);
+			else
+				fprintf (stderr, "Invalid X509 certificate in "
+					 "key %u, skipping the PEM copy\n", i + 1);
+			fprintf (manifest, "\n");
+		} else {
+			sig = (EFI_SIGNATURE_DATA *)list[i].mok;
+			efi_guid_to_str (&sig->SignatureOwner, &owner);
+
+			fp = open_memstream (&text, &text_size);
+			if (!fp) {
+				fprintf (stderr, "Failed to allocate buffer: %m\n");
+				free (owner);
+				goto error;
+			}
+			print_hash_array (fp, &list[i].header->SignatureType,
+					  list[i].mok, list[i].mok_size);
+			fclose (fp);
+
+			snprintf (filename, PATH_MAX, "%s-%04u.txt",
+				  db_friendly_name[db_name], i + 1);
+			if (archive_add (ar, filename, text, text_size) < 0) {
+				free (text);
+				goto entry_error;
+			}
+			free (text);
+			fprintf (manifest, "%u\t%s\t%s\t-\t%s\n", i + 1,
+				 type >= 0 ? sig_types[type].name : "unknown",
+				 owner ? owner : "-", filename);
+		}
+
+		free (owner);
+		continue;
+entry_error:
+		free (owner);
+		fprintf (stderr, "Failed to add %s to the archive\n", filename);
+		goto error;
+	}
+
+	fclose (manifest);
+	manifest = NULL;
+
+	if (archive_add (ar, "MANIFEST", manifest_buf, manifest_size) < 0 ||
+	    archive_finish (ar) < 0) {
+		fprintf (stderr, "Failed to write the archive: %m\n");
+		goto error;
+	}
+
+	ret = 0;
+error:
+	if (manifest)
+		fclose (manifest);
+	free (manifest_buf);
+	free (ar);
+	free (list);
+	free (data);
+
+	return ret;
+}
+
+static int
+set_password (const char *hash_file, const int root_pw, const int clear)
+{
+	uint8_t *data;
+	size_t data_size;
+	pw_crypt_t pw_crypt;
+	uint8_t auth[SHA256_DIGEST_LENGTH];
+	char *password = NULL;
+	unsigned int pw_len;
+	int auth_ret;
+	int ret = -1;
+
+	memset (&pw_crypt, 0, sizeof(pw_crypt_t));
+	memset (auth, 0, SHA256_DIGEST_LENGTH);
+
+	if (hash_file) {
+		if (get_hash_from_file (hash_file, &pw_crypt) < 0) {
+			fprintf (stderr, "Failed to read hash\n");
+			goto error;
+		}
+	} else if (root_pw) {
+		if (get_password_from_shadow (&pw_crypt) < 0) {
+			fprintf (stderr, "Failed to get root password hash\n");
+			goto error;
+		}
+	} else if (!clear) {
+		if (get_password (&password, &pw_len, PASSWORD_MIN, PASSWORD_MAX) < 0) {
+			fprintf (stderr, "Abort\n");
+			goto error;
+		}
+
+		if (!use_simple_hash) {
+			pw_crypt.method = DEFAULT_CRYPT_METHOD;
+			auth_ret = generate_hash (&pw_crypt, password, pw_len);
+		} else {
+			auth_ret = generate_auth (NULL, 0, password, pw_len,
+						  auth);
+		}
+		if (auth_ret < 0) {
+			fprintf (stderr, "Couldn't generate hash\n");
+			goto error;
+		}
+	}
+
+	if (!use_simple_hash) {
+		data = (void *)&pw_crypt;
+		data_size = PASSWORD_CRYPT_SIZE;
 	} else {
 		data = (void *)auth;
 		data_size = SHA256_DIGEST_LENGTH;
@@ -1835,57 +4947,76 @@ enable_validation()
 	return set_toggle("MokSB", 1);
 }
 
+static int32_t
+decode_state_var (const char *name, const uint8_t *data, size_t data_size)
+{
+	if (data_size != 1) {
+		fprintf (stderr, "Strange data size %zd for \"%s\" variable\n",
+			 data_size, name);
+	}
+	if (data_size == 4)
+		return (int32_t)*(uint32_t *)data;
+	else if (data_size == 2)
+		return (int32_t)*(uint16_t *)data;
+	else if (data_size == 1)
+		return (int32_t)*(uint8_t *)data;
+
+	return -1;
+}
+
+/* Read a boolean-ish state variable such as SecureBoot or SetupMode */
 static int
-sb_state ()
+get_state_var (const efi_guid_t *guid, const char *name, int32_t *value)
 {
 	uint8_t *data;
 	size_t data_size;
 	uint32_t attributes;
+
+	*value = -1;
+
+	if (efi_get_variable (*guid, name, &data, &data_size, &attributes) < 0)
+		return -1;
+
+	*value = decode_state_var (name, data, data_size);
+	free (data);
+
+	return 0;
+}
+
+static int
+sb_state ()
+{
+	size_t data_size;
 	int32_t secureboot = -1;
 	int32_t setupmode = -1;
 	int32_t moksbstate = -1;
 
-	if (efi_get_variable (efi_guid_global, "SecureBoot", &data, &data_size,
-			      &attributes) < 0) {
+	if (get_state_var (&efi_guid_global, "SecureBoot", &secureboot) < 0) {
 		fprintf (stderr, "Failed to read \"SecureBoot\" "
 				 "variable: %m\n");
 		return -1;
 	}
 
-	if (data_size != 1) {
-		printf ("Strange data size %zd for \"SecureBoot\" variable\n",
-			data_size);
-	}
-	if (data_size == 4) {
-		secureboot = (int32_t)*(uint32_t *)data;
-	} else if (data_size == 2) {
-		secureboot = (int32_t)*(uint16_t *)data;
-	} else if (data_size == 1) {
-		secureboot = (int32_t)*(uint8_t *)data;
-	}
-
-	if (efi_get_variable (efi_guid_global, "SetupMode", &data, &data_size,
-			      &attributes) < 0) {
-		fprintf (stderr, "Failed to read \"SecureBoot\" "
+	if (get_state_var (&efi_guid_global, "SetupMode", &setupmode) < 0) {
+		fprintf (stderr, "Failed to read \"SetupMode\" "
 				 "variable: %m\n");
 		return -1;
 	}
 
-	if (data_size != 1) {
-		printf ("Strange data size %zd for \"SetupMode\" variable\n",
-			data_size);
-	}
-	if (data_size == 4) {
-		setupmode = (int32_t)*(uint32_t *)data;
-	} else if (data_size == 2) {
-		setupmode = (int32_t)*(uint16_t *)data;
-	} else if (data_size == 1) {
-		setupmode = (int32_t)*(uint8_t *)data;
+	if (efi_get_variable_size (efi_guid_shim, "MokSBStateRT",
+				   &data_size) >= 0) {
+		moksbstate = 1;
 	}
 
-	if (efi_get_variable (efi_guid_shim, "MokSBStateRT", &data, &data_size,
-			      &attributes) >= 0) {
-		moksbstate = 1;
+	if (output_format == OUTPUT_JSON) {
+		printf ("{\"secureboot\":");
+		json_print_bool (stdout, secureboot < 0 ? -1 : secureboot == 1 && setupmode == 0);
+		printf (",\"setup_mode\":");
+		json_print_bool (stdout, setupmode);
+		printf (",\"shim_validation_disabled\":");
+		json_print_bool (stdout, moksbstate == 1);
+		printf ("}\n");
+		return 0;
 	}
 
 	if (secureboot == 1 && setupmode == 0) {
@@ -1900,8 +5031,6 @@ sb_state ()
 		printf ("Cannot determine secure boot state.\n");
 	}
 
-	free (data);
-
 	return 0;
 }
 
@@ -1917,71 +5046,154 @@ enable_db()
 	return set_toggle("MokDB", 1);
 }
 
-static inline int
-read_file(int fd, void **bufp, size_t *lenptr) {
-	int alloced = 0, size = 0, i = 0;
-	void *buf = NULL;
-	void *buf_new = NULL;
+/* Test key files, directories of key files and hashes against a single
+ * snapshot of the databases. Returns 0 if none of the keys is enrolled,
+ * 1 if all of them are, 2 if only some are, or -1 if an item can't be
+ * tested. */
+static int
+test_key (MokRequest req, char **args, uint32_t num)
+{
+	char **files = NULL;
+	char **files_new;
+	uint32_t total = 0;
+	MokItem *items = NULL;
+	MokLoad load;
+	RequestSnapshot snap;
+	efi_guid_t hash_type;
+	uint8_t hash[SHA512_DIGEST_LENGTH];
+	int hash_size;
+	struct stat st;
+	unsigned int enrolled = 0, not_enrolled = 0;
+	int failed = 0;
+	int ret = -1;
 
-	do {
-		size += i;
-		if ((size + 1024) > alloced) {
-			alloced += 4096;
-			buf_new = realloc (buf, alloced + 1);
-			if (buf_new) {
-				buf = buf_new;
-			} else {
-				if (buf)
-					free (buf);
-				return -1;
-			}
+	if (load_request_snapshot (req, &snap) < 0)
+		goto error;
+	for (unsigned int i = 0; i < snap.num; i++) {
+		if (snap.vars[i].err && snap.vars[i].err != ENOENT) {
+			errno = snap.vars[i].err;
+			fprintf (stderr, "Failed to read variable \"%s\": %m\n",
+				 snap.vars[i].name);
+			goto error;
 		}
-	} while ((i = read (fd, buf + size, 1024)) > 0);
-
-	if (i < 0) {
-		free (buf);
-		return -1;
 	}
 
-	*bufp = buf;
-	*lenptr = size;
-
-	return 0;
-}
+	for (uint32_t i = 0; i < num; i++) {
+		if (stat (args[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+			if (collect_dir_files (args[i], NULL, &files, &total) < 0)
+				goto error;
+			continue;
+		}
 
-static int
-test_key (MokRequest req, const char *key_file)
-{
-	void *key = NULL;
-	size_t read_size;
-	int fd, rc, ret = -1;
+		files_new = realloc (files, (total + 1) * sizeof(char *));
+		if (!files_new) {
+			fprintf (stderr, "Could not allocate space: %m\n");
+			goto error;
+		}
+		files = files_new;
+		files[total] = strdup (args[i]);
+		if (!files[total]) {
+			fprintf (stderr, "Could not allocate space: %m\n");
+			goto error;
+		}
+		total++;
+	}
 
-	fd = open (key_file, O_RDONLY);
-	if (fd < 0) {
-		fprintf (stderr, "Failed to open %s\n", key_file);
+	if (total == 0) {
+		fprintf (stderr, "No key files found\n");
 		goto error;
 	}
 
-	rc = read_file (fd, &key, &read_size);
-	if (rc < 0) {
-		fprintf (stderr, "Failed to read %s\n", key_file);
+	items = calloc (total, sizeof(MokItem));
+	if (!items) {
+		fprintf (stderr, "Failed to allocate space for the keys\n");
 		goto error;
 	}
 
-	if (is_valid_request (&efi_guid_x509_cert, key, read_size, req)) {
-		printf ("%s is not enrolled\n", key_file);
-		ret = 0;
-	} else {
-		printf ("%s is already enrolled\n", key_file);
-		ret = 1;
+	/* Anything that isn't a file but reads as a hash is a hash */
+	for (uint32_t i = 0; i < total; i++) {
+		items[i].filename = files[i];
+
+		if (stat (files[i], &st) == 0 || errno != ENOENT)
+			continue;
+
+		hash_size = identify_hash_type (files[i], &hash_type);
+		if (hash_size < 0 ||
+		    hex_str_to_binary (files[i], hash, hash_size) < 0)
+			continue;
+
+		if (add_key (&items[i], hash, hash_size) < 0) {
+			fprintf (stderr, "Failed to allocate space for the keys\n");
+			goto error;
+		}
+		items[i].keys[0].check = check_request (&snap, &hash_type, hash,
+							hash_size);
+		items[i].state = ITEM_LOADED;
 	}
 
-error:
-	if (key)
-		free (key);
+	/* Load and check the key files in parallel */
+	load.items = items;
+	load.snap = &snap;
+	run_parallel (total, load_mok_item, NULL, &load);
 
-	if (fd >= 0)
-		close (fd);
+	for (uint32_t i = 0; i < total; i++) {
+		MokItem *item = &items[i];
+
+		switch (item->state) {
+		case ITEM_UNREADABLE:
+			errno = item->err;
+			fprintf (stderr, "Failed to read %s: %m\n", files[i]);
+			failed = 1;
+			continue;
+		case ITEM_INVALID:
+			fprintf (stderr, "%s is not a valid x509 certificate in DER, PEM or PKCS#7 format\n",
+				 files[i]);
+			failed = 1;
+			continue;
+		default:
+			break;
+		}
+
+		for (unsigned int k = 0; k < item->key_num; k++) {
+			char buf[PATH_MAX + 32];
+			const char *label = key_label (buf, sizeof(buf), item, k);
+			int check = item->keys[k].check;
+
+			if (check < 0) {
+				printf ("%s is not enrolled\n", label);
+				not_enrolled++;
+			} else if (snap.checks[check]->revoked) {
+				printf ("%s is revoked (%s)\n", label,
+					snap.checks[check]->name);
+				not_enrolled++;
+			} else {
+				printf ("%s is already enrolled (%s)\n", label,
+					snap.checks[check]->name);
+				enrolled++;
+			}
+		}
+	}
+
+	if (failed)
+		ret = -1;
+	else if (enrolled == 0)
+		ret = 0;
+	else if (not_enrolled == 0)
+		ret = 1;
+	else
+		ret = 2;
+error:
+	if (items) {
+		for (uint32_t i = 0; i < total; i++)
+			free_mok_item (&items[i]);
+		free (items);
+	}
+	if (files) {
+		for (uint32_t i = 0; i < total; i++)
+			free (files[i]);
+		free (files);
+	}
+	free_request_snapshot (&snap);
 
 	return ret;
 }
@@ -2015,133 +5227,2481 @@ generate_pw_hash (const char *input_pw)
 			return -1;
 		}
 
-		password = strdup (input_pw);
+		password = strdup (input_pw);
+
+		if (!password) {
+			fprintf (stderr, "Failed to duplicate string\n");
+			return -1;
+		}
+	} else {
+		if (get_password (&password, &pw_len, PASSWORD_MIN, PASSWORD_MAX) < 0) {
+			fprintf (stderr, "Abort\n");
+			return -1;
+		}
+	}
+
+	prefix = get_crypt_prefix (DEFAULT_CRYPT_METHOD);
+	if (!prefix)
+		return -1;
+
+	memset (settings, 0, sizeof (settings));
+	next = stpncpy (settings, prefix, settings_len);
+	salt_size = get_salt_size (DEFAULT_CRYPT_METHOD);
+	if (salt_size > settings_len - (next - settings)) {
+		free(password);
+		errno = EOVERFLOW;
+		return -1;
+	}
+	generate_salt (next, salt_size);
+	next += salt_size;
+	*next = '\0';
+
+	crypt_string = crypt (password, settings);
+	free (password);
+	if (!crypt_string) {
+		fprintf (stderr, "Failed to generate hash\n");
+		return -1;
+	}
+
+	printf ("%s\n", crypt_string);
+
+	return 0;
+}
+
+static int
+set_timeout (char *t)
+{
+	int timeout = strtol(t, NULL, 10);
+
+	if (errno == ERANGE || timeout > 0x7fff)
+		timeout = 0x7fff;
+	if (timeout < 0)
+		timeout = -1;
+
+	if (timeout != 10) {
+		uint32_t attributes = EFI_VARIABLE_NON_VOLATILE
+				      | EFI_VARIABLE_BOOTSERVICE_ACCESS
+				      | EFI_VARIABLE_RUNTIME_ACCESS;
+		if (efi_set_variable (efi_guid_shim, "MokTimeout",
+				      (uint8_t *)&timeout, sizeof (timeout),
+				      attributes, S_IRUSR | S_IWUSR) < 0) {
+			fprintf (stderr, "Failed to set MokTimeout\n");
+			return -1;
+		}
+	} else {
+		return test_and_delete_var ("MokTimeout");
+	}
+
+	return 0;
+}
+
+static int
+set_verbosity (uint8_t verbosity)
+{
+	if (verbosity) {
+		uint32_t attributes = EFI_VARIABLE_NON_VOLATILE
+				      | EFI_VARIABLE_BOOTSERVICE_ACCESS
+				      | EFI_VARIABLE_RUNTIME_ACCESS;
+		if (efi_set_variable (efi_guid_shim, "SHIM_VERBOSE",
+				      (uint8_t *)&verbosity, sizeof (verbosity),
+				      attributes, S_IRUSR | S_IWUSR) < 0) {
+			fprintf (stderr, "Failed to set SHIM_VERBOSE\n");
+			return -1;
+		}
+	} else {
+		return test_and_delete_var ("SHIM_VERBOSE");
+	}
+
+	return 0;
+}
+
+static inline int
+list_db (DBName db_name)
+{
+	switch (db_name) {
+		case MOK_LIST_RT:
+			return list_keys_in_var ("MokListRT", efi_guid_shim);
+		case MOK_LIST_X_RT:
+			return list_keys_in_var ("MokListXRT", efi_guid_shim);
+		case PK:
+			return list_keys_in_var ("PK", efi_guid_global);
+		case KEK:
+			return list_keys_in_var ("KEK", efi_guid_global);
+		case DB:
+			return list_keys_in_var ("db", efi_guid_security);
+		case DBX:
+			return list_keys_in_var ("dbx", efi_guid_security);
+	}
+
+	return -1;
+}
+
+typedef struct {
+	const char       *name;
+	const efi_guid_t *guid;
+} BenchVar;
+
+static int
+cmp_double (const void *a, const void *b)
+{
+	const double x = *(const double *)a;
+	const double y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double
+elapsed_us (const struct timespec *start, const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1e6 +
+	       (end->tv_nsec - start->tv_nsec) / 1e3;
+}
+
+/* nearest-rank percentile of a sorted array */
+static double
+percentile (const double *sorted, unsigned int n, unsigned int p)
+{
+	unsigned int rank = (p * n + 99) / 100;
+
+	if (rank == 0)
+		rank = 1;
+
+	return sorted[rank - 1];
+}
+
+static void
+print_bench_result (const char *label, size_t size, double *samples,
+		    unsigned int n)
+{
+	if (n == 0)
+		return;
+
+	qsort (samples, n, sizeof(double), cmp_double);
+	printf ("%-16s %8zu %6u %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+		label, size, n, samples[0], percentile (samples, n, 50),
+		percentile (samples, n, 90), percentile (samples, n, 99),
+		samples[n - 1]);
+}
+
+static int
+bench_read (const BenchVar *var, unsigned int iterations, double *samples)
+{
+	uint8_t *data;
+	size_t data_size = 0;
+	uint32_t attributes;
+	struct timespec start, end;
+	unsigned int n = 0;
+
+	for (unsigned int i = 0; i < iterations; i++) {
+		clock_gettime (CLOCK_MONOTONIC, &start);
+		if (efi_get_variable (*var->guid, var->name, &data, &data_size,
+				      &attributes) < 0) {
+			if (errno == ENOENT) {
+				printf ("%-16s %8s\n", var->name, "absent");
+				return 0;
+			}
+			fprintf (stderr, "Failed to read %s: %m\n", var->name);
+			return -1;
+		}
+		clock_gettime (CLOCK_MONOTONIC, &end);
+		free (data);
+
+		samples[n++] = elapsed_us (&start, &end);
+	}
+
+	print_bench_result (var->name, data_size, samples, n);
+
+	return 0;
+}
+
+static int
+bench_write (unsigned int cycles, double *samples)
+{
+	const size_t sizes[] = {16, 256, 4096, 16384};
+	double *set_samples = samples;
+	double *upd_samples = samples + cycles;
+	double *del_samples = samples + cycles * 2;
+	uint8_t *data = NULL;
+	size_t size;
+	struct timespec start, end;
+	unsigned int set_n, upd_n, del_n;
+	int ret = -1;
+	uint32_t attributes = EFI_VARIABLE_NON_VOLATILE
+			      | EFI_VARIABLE_BOOTSERVICE_ACCESS
+			      | EFI_VARIABLE_RUNTIME_ACCESS;
+
+	if (efi_get_variable_size (efi_guid_shim, BENCH_VAR_NAME, &size) == 0) {
+		fprintf (stderr, "\"%s\" already exists, refusing to overwrite it\n",
+			 BENCH_VAR_NAME);
+		return -1;
+	} else if (errno != ENOENT) {
+		fprintf (stderr, "Failed to access variable \"%s\": %m\n",
+			 BENCH_VAR_NAME);
+		return -1;
+	}
+
+	data = malloc (sizes[sizeof(sizes)/sizeof(sizes[0]) - 1]);
+	if (!data) {
+		fprintf (stderr, "Failed to allocate buffer: %m\n");
+		return -1;
+	}
+
+	for (unsigned int s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s++) {
+		size = sizes[s];
+		set_n = upd_n = del_n = 0;
+
+		for (unsigned int i = 0; i < cycles; i++) {
+			memset (data, i, size);
+
+			/* create */
+			clock_gettime (CLOCK_MONOTONIC, &start);
+			if (efi_set_variable (efi_guid_shim, BENCH_VAR_NAME,
+					      data, size, attributes,
+					      S_IRUSR | S_IWUSR) < 0)
+				goto fail;
+			clock_gettime (CLOCK_MONOTONIC, &end);
+			set_samples[set_n++] = elapsed_us (&start, &end);
+
+			/* overwrite */
+			data[0] ^= 0xff;
+			clock_gettime (CLOCK_MONOTONIC, &start);
+			if (efi_set_variable (efi_guid_shim, BENCH_VAR_NAME,
+					      data, size, attributes,
+					      S_IRUSR | S_IWUSR) < 0)
+				goto fail;
+			clock_gettime (CLOCK_MONOTONIC, &end);
+			upd_samples[upd_n++] = elapsed_us (&start, &end);
+
+			/* delete */
+			clock_gettime (CLOCK_MONOTONIC, &start);
+			if (efi_del_variable (efi_guid_shim, BENCH_VAR_NAME) < 0)
+				goto fail;
+			clock_gettime (CLOCK_MONOTONIC, &end);
+			del_samples[del_n++] = elapsed_us (&start, &end);
+		}
+
+		print_bench_result ("create", size, set_samples, set_n);
+		print_bench_result ("write", size, upd_samples, upd_n);
+		print_bench_result ("delete", size, del_samples, del_n);
+	}
+
+	ret = 0;
+	goto done;
+fail:
+	fprintf (stderr, "Failed to write %zu bytes to \"%s\": %m\n", size,
+		 BENCH_VAR_NAME);
+	test_and_delete_var (BENCH_VAR_NAME);
+
+	/* Nothing could be written at all */
+	if (size == sizes[0] && set_n == 0)
+		goto done;
+
+	/* The firmware may refuse large variables; report what we have */
+	print_bench_result ("create", size, set_samples, set_n);
+	print_bench_result ("write", size, upd_samples, upd_n);
+	print_bench_result ("delete", size, del_samples, del_n);
+	printf ("Variables of %zu bytes or more were rejected\n", size);
+	ret = 0;
+done:
+	free (data);
+
+	return ret;
+}
+
+static int
+bench_firmware (unsigned int iterations, int write_test)
+{
+	const BenchVar read_vars[] = {
+		{"SecureBoot",   &efi_guid_global},
+		{"SetupMode",    &efi_guid_global},
+		{"PK",           &efi_guid_global},
+		{"KEK",          &efi_guid_global},
+		{"db",           &efi_guid_security},
+		{"dbx",          &efi_guid_security},
+		{"MokListRT",    &efi_guid_shim},
+		{"MokListXRT",   &efi_guid_shim},
+		{"MokSBStateRT", &efi_guid_shim},
+	};
+	unsigned int n_samples;
+	double *samples;
+	int ret = 0;
+
+	n_samples = iterations;
+	if (write_test && n_samples < BENCH_WRITE_CYCLES * 3)
+		n_samples = BENCH_WRITE_CYCLES * 3;
+
+	samples = malloc (n_samples * sizeof(double));
+	if (!samples) {
+		fprintf (stderr, "Failed to allocate samples: %m\n");
+		return -1;
+	}
+
+	printf ("Latency in microseconds\n");
+	printf ("%-16s %8s %6s %10s %10s %10s %10s %10s\n", "variable",
+		"bytes", "n", "min", "p50", "p90", "p99", "max");
+	for (unsigned int i = 0; i < sizeof(read_vars)/sizeof(read_vars[0]); i++) {
+		if (bench_read (&read_vars[i], iterations, samples) < 0)
+			ret = -1;
+	}
+
+	if (write_test) {
+		printf ("\n%-16s %8s %6s %10s %10s %10s %10s %10s\n", BENCH_VAR_NAME,
+			"bytes", "n", "min", "p50", "p90", "p99", "max");
+		if (bench_write (BENCH_WRITE_CYCLES, samples) < 0)
+			ret = -1;
+	}
+
+	free (samples);
+
+	return ret;
+}
+
+static const char *pending_var_names[] = {
+	"MokNew",
+	"MokDel",
+	"MokXNew",
+	"MokXDel",
+	"MokPW",
+	"MokSB",
+	"MokDB",
+};
+#define PENDING_NUM (sizeof(pending_var_names)/sizeof(pending_var_names[0]))
+/* MokNew, MokDel, MokXNew and MokXDel carry signature lists */
+#define PENDING_KEY_LISTS 4
+
+typedef struct {
+	DBStats  stats;
+	int      has_expiry;
+	time_t   earliest_expiry;
+} DBMetrics;
+
+static int
+collect_db_metrics (DBName db_name, DBMetrics *m)
+{
+	uint8_t *data;
+	size_t data_size;
+	uint32_t attributes;
+	EFI_SIGNATURE_LIST *CertList = NULL;
+	int corrupted;
+
+	memset (m, 0, sizeof(DBMetrics));
+
+	if (efi_get_variable (*db_var_guid[db_name], db_var_name[db_name],
+			      &data, &data_size, &attributes) < 0) {
+		if (errno == ENOENT)
+			return 0;
+		fprintf (stderr, "Failed to read %s: %m\n", db_var_name[db_name]);
+		return -1;
+	}
+
+	count_signatures (data, data_size, &m->stats);
+	if (m->stats.corrupted)
+		fprintf (stderr, "Corrupted signature list in %s\n",
+			 db_var_name[db_name]);
+
+	while ((CertList = next_signature_list (data, data_size, CertList,
+						&corrupted))) {
+		if (efi_guid_cmp (&CertList->SignatureType, &efi_guid_x509_cert) != 0)
+			continue;
+
+		for (uint32_t i = 0; i < signature_count (CertList); i++) {
+			EFI_SIGNATURE_DATA *Cert = signature_at (CertList, i);
+			time_t start, expiry;
+
+			if (der_cert_validity (Cert->SignatureData,
+					       CertList->SignatureSize -
+					       sizeof(efi_guid_t),
+					       &start, &expiry) == 0 &&
+			    (!m->has_expiry || expiry < m->earliest_expiry)) {
+				m->has_expiry = 1;
+				m->earliest_expiry = expiry;
+			}
+		}
+	}
+
+	free (data);
+
+	return 0;
+}
+
+static int
+write_metrics (const char *metrics_file)
+{
+	DBMetrics db_metrics[DB_NUM];
+	char *tmp_file = NULL;
+	FILE *fp = NULL;
+	size_t size;
+	int32_t secureboot, setupmode;
+	int fd = -1;
+	int ret = -1;
+
+	if (get_state_var (&efi_guid_global, "SecureBoot", &secureboot) < 0 ||
+	    get_state_var (&efi_guid_global, "SetupMode", &setupmode) < 0) {
+		fprintf (stderr, "Failed to read Secure Boot state: %m\n");
+		return -1;
+	}
+
+	for (unsigned int i = 0; i < DB_NUM; i++) {
+		if (collect_db_metrics (i, &db_metrics[i]) < 0)
+			return -1;
+	}
+
+	/* Write to a temporary file and rename it so that the collector
+	 * never sees a partially written file */
+	tmp_file = malloc (strlen (metrics_file) + sizeof(".XXXXXX"));
+	if (!tmp_file) {
+		fprintf (stderr, "Could not allocate space: %m\n");
+		return -1;
+	}
+	sprintf (tmp_file, "%s.XXXXXX", metrics_file);
+
+	fd = mkstemp (tmp_file);
+	if (fd < 0) {
+		fprintf (stderr, "Failed to create %s: %m\n", tmp_file);
+		goto error;
+	}
+	fchmod (fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+
+	fp = fdopen (fd, "w");
+	if (!fp) {
+		fprintf (stderr, "Failed to open %s: %m\n", tmp_file);
+		close (fd);
+		unlink (tmp_file);
+		goto error;
+	}
+
+	fprintf (fp, "# HELP mokutil_secureboot_enabled Whether UEFI Secure Boot is enabled.\n");
+	fprintf (fp, "# TYPE mokutil_secureboot_enabled gauge\n");
+	fprintf (fp, "mokutil_secureboot_enabled %d\n", secureboot == 1 ? 1 : 0);
+	fprintf (fp, "# HELP mokutil_setup_mode Whether the platform is in Setup Mode.\n");
+	fprintf (fp, "# TYPE mokutil_setup_mode gauge\n");
+	fprintf (fp, "mokutil_setup_mode %d\n", setupmode == 1 ? 1 : 0);
+	fprintf (fp, "# HELP mokutil_shim_validation_disabled Whether shim validation is disabled (MokSBState).\n");
+	fprintf (fp, "# TYPE mokutil_shim_validation_disabled gauge\n");
+	fprintf (fp, "mokutil_shim_validation_disabled %d\n",
+		 efi_get_variable_size (efi_guid_shim, "MokSBStateRT", &size) == 0);
+
+	fprintf (fp, "# HELP mokutil_signature_entries Number of signatures in the database.\n");
+	fprintf (fp, "# TYPE mokutil_signature_entries gauge\n");
+	for (unsigned int i = 0; i < DB_NUM; i++) {
+		for (unsigned int t = 0; t < SIG_TYPE_NUM; t++) {
+			if (db_metrics[i].stats.count[t] == 0)
+				continue;
+			fprintf (fp, "mokutil_signature_entries{database=\"%s\",type=\"%s\"} %lu\n",
+				 db_var_name[i], sig_types[t].name,
+				 (unsigned long)db_metrics[i].stats.count[t]);
+		}
+	}
+
+	fprintf (fp, "# HELP mokutil_database_bytes Size of the database variable in bytes.\n");
+	fprintf (fp, "# TYPE mokutil_database_bytes gauge\n");
+	for (unsigned int i = 0; i < DB_NUM; i++) {
+		fprintf (fp, "mokutil_database_bytes{database=\"%s\"} %zu\n",
+			 db_var_name[i], db_metrics[i].stats.size);
+	}
+
+	fprintf (fp, "# HELP mokutil_pending_request Whether a request for MokManager is pending.\n");
+	fprintf (fp, "# TYPE mokutil_pending_request gauge\n");
+	for (unsigned int i = 0; i < PENDING_NUM; i++) {
+		fprintf (fp, "mokutil_pending_request{request=\"%s\"} %d\n",
+			 pending_var_names[i],
+			 efi_get_variable_size (efi_guid_shim, pending_var_names[i],
+						&size) == 0);
+	}
+
+	fprintf (fp, "# HELP mokutil_cert_earliest_expiry_timestamp_seconds Earliest notAfter of the certificates in the database.\n");
+	fprintf (fp, "# TYPE mokutil_cert_earliest_expiry_timestamp_seconds gauge\n");
+	for (unsigned int i = 0; i < DB_NUM; i++) {
+		if (!db_metrics[i].has_expiry)
+			continue;
+		fprintf (fp, "mokutil_cert_earliest_expiry_timestamp_seconds{database=\"%s\"} %lld\n",
+			 db_var_name[i], (long long)db_metrics[i].earliest_expiry);
+	}
+
+	if (fclose (fp) != 0) {
+		fprintf (stderr, "Failed to write %s: %m\n", tmp_file);
+		unlink (tmp_file);
+		goto error;
+	}
+
+	if (rename (tmp_file, metrics_file) < 0) {
+		fprintf (stderr, "Failed to rename %s: %m\n", tmp_file);
+		unlink (tmp_file);
+		goto error;
+	}
+
+	ret = 0;
+error:
+	free (tmp_file);
+
+	return ret;
+}
+
+/* Index the keys of variables read by read_var_entries(). A missing
+ * variable has no list. Returns -1 if one can't be read or is corrupted. */
+static int
+build_var_lists (const EfiVarEntry *vars, unsigned int var_num,
+		 MokListNode **lists, uint32_t *node_nums, uint32_t *total)
+{
+	*total = 0;
+	for (unsigned int i = 0; i < var_num; i++) {
+		lists[i] = NULL;
+		node_nums[i] = 0;
+		if (!vars[i].data) {
+			if (vars[i].err != ENOENT) {
+				errno = vars[i].err;
+				fprintf (stderr, "Failed to read %s: %m\n",
+					 vars[i].name);
+				return -1;
+			}
+			continue;
+		}
+
+		lists[i] = build_mok_list (vars[i].data, vars[i].size,
+					   &node_nums[i]);
+		if (!lists[i]) {
+			fprintf (stderr, "Corrupted signature list in %s\n",
+				 vars[i].name);
+			return -1;
+		}
+		*total += node_nums[i];
+	}
+
+	return 0;
+}
+
+/* Print the variables of the checks in the mask as a JSON array, or as a
+ * comma separated list */
+static void
+print_check_names (const RequestSnapshot *snap, uint32_t mask)
+{
+	unsigned int n = 0;
+
+	if (output_format == OUTPUT_JSON)
+		printf ("[");
+
+	for (unsigned int i = 0; i < snap->num; i++) {
+		if (!((mask >> i) & 1))
+			continue;
+		if (output_format == OUTPUT_JSON)
+			printf ("%s\"%s\"", n++ > 0 ? "," : "",
+				snap->checks[i]->name);
+		else
+			printf ("%s %s", n++ > 0 ? "," : "",
+				snap->checks[i]->name);
+	}
+
+	if (output_format == OUTPUT_JSON)
+		printf ("]");
+}
+
+/* An enrolled certificate checked by --audit */
+typedef struct {
+	DBName      db;
+	uint32_t    index;
+	const void *cert;
+	uint32_t    cert_size;
+	uint32_t    revoked;
+	uint8_t     sha256[SHA256_DIGEST_LENGTH];
+	char       *cn;
+} AuditKey;
+
+typedef struct {
+	AuditKey              *keys;
+	const RequestSnapshot *snap;
+} Audit;
+
+static void
+audit_key (void *ctx, unsigned int index)
+{
+	Audit *audit = ctx;
+	AuditKey *key = &audit->keys[index];
+
+	key->revoked = request_check_mask (audit->snap, &efi_guid_x509_cert,
+					   key->cert, key->cert_size);
+	if (!key->revoked)
+		return;
+
+	SHA256 (key->cert, key->cert_size, key->sha256);
+	key->cn = get_subject_cn (key->cert, key->cert_size);
+}
+
+/* Check every certificate in PK, KEK, db and MokListRT against dbx and
+ * MokListXRT, by content and by the hashes of the certificate and of its
+ * TBSCertificate. Returns 1 if any certificate is revoked. */
+static int
+audit_keys ()
+{
+	const DBName audited[] = { PK, KEK, DB, MOK_LIST_RT };
+	EfiVarEntry vars[sizeof(audited)/sizeof(audited[0])];
+	unsigned int var_num = sizeof(audited)/sizeof(audited[0]);
+	MokListNode *lists[sizeof(audited)/sizeof(audited[0])] = {NULL};
+	uint32_t node_nums[sizeof(audited)/sizeof(audited[0])] = {0};
+	RequestSnapshot snap;
+	AuditKey *keys = NULL;
+	uint32_t key_num = 0, revoked = 0;
+	Audit audit;
+	int ret = -1;
+
+	for (unsigned int i = 0; i < var_num; i++) {
+		vars[i].guid = db_var_guid[audited[i]];
+		vars[i].name = db_var_name[audited[i]];
+	}
+	read_var_entries (vars, var_num);
+	if (load_revocation_snapshot (&snap) < 0)
+		goto error;
+
+	for (unsigned int i = 0; i < snap.num; i++) {
+		if (snap.vars[i].err && snap.vars[i].err != ENOENT) {
+			errno = snap.vars[i].err;
+			fprintf (stderr, "Failed to read %s: %m\n",
+				 snap.vars[i].name);
+			goto error;
+		}
+	}
+
+	if (build_var_lists (vars, var_num, lists, node_nums, &key_num) < 0)
+		goto error;
+
+	keys = calloc (key_num + 1, sizeof(AuditKey));
+	if (!keys) {
+		fprintf (stderr, "Failed to allocate space: %m\n");
+		goto error;
+	}
+
+	/* Number the keys as the list commands do */
+	key_num = 0;
+	for (unsigned int i = 0; i < var_num; i++) {
+		for (uint32_t n = 0; n < node_nums[i]; n++) {
+			if (efi_guid_cmp (&lists[i][n].header->SignatureType,
+					  &efi_guid_x509_cert) != 0)
+				continue;
+			keys[key_num].db = audited[i];
+			keys[key_num].index = n + 1;
+			keys[key_num].cert = lists[i][n].mok;
+			keys[key_num].cert_size = lists[i][n].mok_size;
+			key_num++;
+		}
+	}
+
+	audit.keys = keys;
+	audit.snap = &snap;
+	run_parallel (key_num, audit_key, NULL, &audit);
+
+	if (output_format == OUTPUT_JSON)
+		printf ("{\"revoked\":[");
+
+	for (uint32_t k = 0; k < key_num; k++) {
+		AuditKey *key = &keys[k];
+
+		if (!key->revoked)
+			continue;
+
+		if (output_format == OUTPUT_JSON) {
+			printf ("%s\n{\"database\":\"%s\",\"index\":%u,\"sha256\":",
+				revoked > 0 ? "," : "", db_var_name[key->db],
+				key->index);
+			json_print_hex (stdout, key->sha256, SHA256_DIGEST_LENGTH);
+			printf (",\"subject_cn\":");
+			json_print_string (stdout, key->cn);
+			printf (",\"revoked_by\":");
+			print_check_names (&snap, key->revoked);
+			printf ("}");
+		} else {
+			printf ("%s [key %u] ", db_var_name[key->db], key->index);
+			print_sha256 (key->sha256);
+			printf (" %s: revoked by", key->cn ? key->cn : "");
+			print_check_names (&snap, key->revoked);
+			printf ("\n");
+		}
+		revoked++;
+	}
+
+	if (output_format == OUTPUT_JSON)
+		printf ("\n],\"checked\":%u}\n", key_num);
+	else
+		printf ("%u certificate(s) checked, %u revoked\n", key_num,
+			revoked);
+
+	ret = revoked > 0;
+error:
+	if (keys) {
+		for (uint32_t k = 0; k < key_num; k++)
+			free (keys[k].cn);
+		free (keys);
+	}
+	for (unsigned int i = 0; i < var_num; i++)
+		free (lists[i]);
+	free_var_entries (vars, var_num);
+	free_request_snapshot (&snap);
+
+	return ret;
+}
+
+/* A certificate in the signatures of an image that is revoked */
+typedef struct {
+	uint8_t   sha256[SHA256_DIGEST_LENGTH];
+	char     *cn;
+	uint32_t  revoked;
+} ScanSigner;
+
+/* A file checked by --scan-boot */
+typedef struct {
+	const char *file;
+	int         err;		/* ENOEXEC if it's not a PE/COFF image */
+	uint8_t     sha256[SHA256_DIGEST_LENGTH];
+	uint32_t    revoked;		/* by the Authenticode hash */
+	ScanSigner *signers;
+	uint32_t    signer_num;
+} ScanImage;
+
+typedef struct {
+	ScanImage             *images;
+	const RequestSnapshot *snap;
+	int                    sha1;
+	unsigned int           scanned;
+	unsigned int           revoked;
+	unsigned int           failed;
+} BootScan;
+
+/* Check every certificate of a PKCS#7 signature, the signer as well as
+ * the chain it carries */
+static void
+scan_signature (BootScan *scan, ScanImage *image, const uint8_t *sig,
+		uint32_t sig_size)
+{
+	const unsigned char *ptr = sig;
+	STACK_OF(X509) *certs = NULL;
+	ScanSigner *signers_new;
+	unsigned char *der;
+	uint32_t revoked;
+	PKCS7 *p7;
+	int len;
+
+	p7 = d2i_PKCS7 (NULL, &ptr, sig_size);
+	if (!p7)
+		return;
+
+	if (PKCS7_type_is_signed (p7) && p7->d.sign)
+		certs = p7->d.sign->cert;
+
+	for (int i = 0; i < sk_X509_num (certs); i++) {
+		der = NULL;
+		len = i2d_X509 (sk_X509_value (certs, i), &der);
+		if (len <= 0)
+			continue;
+
+		revoked = request_check_mask (scan->snap, &efi_guid_x509_cert,
+					      der, len);
+		if (revoked) {
+			signers_new = realloc (image->signers,
+					       (image->signer_num + 1) *
+					       sizeof(ScanSigner));
+			if (signers_new) {
+				image->signers = signers_new;
+				SHA256 (der, len,
+					image->signers[image->signer_num].sha256);
+				image->signers[image->signer_num].cn =
+					get_subject_cn (der, len);
+				image->signers[image->signer_num].revoked = revoked;
+				image->signer_num++;
+			}
+		}
+		OPENSSL_free (der);
+	}
+
+	PKCS7_free (p7);
+}
+
+static void
+scan_image (void *ctx, unsigned int index)
+{
+	BootScan *scan = ctx;
+	ScanImage *image = &scan->images[index];
+	uint8_t sha1[SHA_DIGEST_LENGTH];
+	const uint8_t *sig;
+	uint32_t sig_size, pos = 0;
+	pe_image_t pe;
+
+	if (pe_image_open (&pe, image->file) < 0) {
+		image->err = errno;
+		return;
+	}
+
+	if (pe_image_digest (&pe, EVP_sha256 (), image->sha256, NULL) < 0) {
+		image->err = errno ? errno : EIO;
+		pe_image_close (&pe);
+		return;
+	}
+	image->revoked = match_hash_index (scan->snap, image->sha256,
+					   SHA256_DIGEST_LENGTH, 0);
+
+	/* Only worth another pass if there is a SHA-1 hash to match */
+	if (scan->sha1 && pe_image_digest (&pe, EVP_sha1 (), sha1, NULL) == 0)
+		image->revoked |= match_hash_index (scan->snap, sha1,
+						    SHA_DIGEST_LENGTH, 0);
+
+	while (pe_image_next_signature (&pe, &pos, &sig, &sig_size))
+		scan_signature (scan, image, sig, sig_size);
+
+	pe_image_close (&pe);
+}
+
+static void
+print_scan_image (void *ctx, unsigned int index)
+{
+	BootScan *scan = ctx;
+	ScanImage *image = &scan->images[index];
+
+	if (image->err == ENOEXEC) {
+		return;
+	} else if (image->err) {
+		errno = image->err;
+		fprintf (stderr, "Failed to read %s: %m\n", image->file);
+		scan->failed++;
+		return;
+	}
+	scan->scanned++;
+
+	if (!image->revoked && image->signer_num == 0)
+		return;
+
+	if (output_format == OUTPUT_JSON) {
+		printf ("%s\n{\"file\":", scan->revoked > 0 ? "," : "");
+		json_print_string (stdout, image->file);
+		printf (",\"sha256\":");
+		json_print_hex (stdout, image->sha256, SHA256_DIGEST_LENGTH);
+		printf (",\"revoked_by\":");
+		print_check_names (scan->snap, image->revoked);
+		printf (",\"signers\":[");
+		for (uint32_t s = 0; s < image->signer_num; s++) {
+			printf ("%s{\"sha256\":", s > 0 ? "," : "");
+			json_print_hex (stdout, image->signers[s].sha256,
+					SHA256_DIGEST_LENGTH);
+			printf (",\"subject_cn\":");
+			json_print_string (stdout, image->signers[s].cn);
+			printf (",\"revoked_by\":");
+			print_check_names (scan->snap, image->signers[s].revoked);
+			printf ("}");
+		}
+		printf ("]}");
+	} else {
+		if (image->revoked) {
+			printf ("%s image ", image->file);
+			print_sha256 (image->sha256);
+			printf (": revoked by");
+			print_check_names (scan->snap, image->revoked);
+			printf ("\n");
+		}
+		for (uint32_t s = 0; s < image->signer_num; s++) {
+			printf ("%s signer ", image->file);
+			print_sha256 (image->signers[s].sha256);
+			printf (" %s: revoked by", image->signers[s].cn ?
+						     image->signers[s].cn : "");
+			print_check_names (scan->snap, image->signers[s].revoked);
+			printf ("\n");
+		}
+	}
+	scan->revoked++;
+}
+
+/* Check every PE/COFF image under a directory against dbx and MokListXRT,
+ * by its Authenticode hash and by the certificates of its signatures.
+ * Returns 1 if any image is revoked. */
+static int
+scan_boot (const char *dir)
+{
+	RequestSnapshot snap;
+	BootScan scan;
+	char **files = NULL;
+	uint32_t total = 0;
+	int ret = -1;
+
+	memset (&scan, 0, sizeof(scan));
+	if (load_revocation_snapshot (&snap) < 0)
+		goto error;
+
+	for (unsigned int i = 0; i < snap.num; i++) {
+		if (snap.vars[i].err && snap.vars[i].err != ENOENT) {
+			errno = snap.vars[i].err;
+			fprintf (stderr, "Failed to read %s: %m\n",
+				 snap.vars[i].name);
+			goto error;
+		}
+	}
+
+	for (uint32_t i = 0; i < snap.hash_index_num; i++) {
+		if (!snap.hash_index[i].tbs &&
+		    snap.hash_index[i].size == SHA_DIGEST_LENGTH)
+			scan.sha1 = 1;
+	}
+
+	if (collect_dir_files (dir, NULL, &files, &total) < 0)
+		goto error;
+
+	scan.images = calloc (total + 1, sizeof(ScanImage));
+	if (!scan.images) {
+		fprintf (stderr, "Failed to allocate space: %m\n");
+		goto error;
+	}
+	for (uint32_t i = 0; i < total; i++)
+		scan.images[i].file = files[i];
+	scan.snap = &snap;
+
+	if (output_format == OUTPUT_JSON)
+		printf ("{\"revoked\":[");
+
+	run_parallel (total, scan_image, print_scan_image, &scan);
+
+	if (output_format == OUTPUT_JSON)
+		printf ("\n],\"scanned\":%u}\n", scan.scanned);
+	else
+		printf ("%u image(s) scanned, %u revoked\n", scan.scanned,
+			scan.revoked);
+
+	ret = scan.failed ? -1 : scan.revoked > 0;
+error:
+	if (scan.images) {
+		for (uint32_t i = 0; i < total; i++) {
+			for (uint32_t s = 0; s < scan.images[i].signer_num; s++)
+				free (scan.images[i].signers[s].cn);
+			free (scan.images[i].signers);
+		}
+		free (scan.images);
+	}
+	if (files) {
+		for (uint32_t i = 0; i < total; i++)
+			free (files[i]);
+		free (files);
+	}
+	free_request_snapshot (&snap);
+
+	return ret;
+}
+
+/* An enrolled certificate a signature may chain to */
+typedef struct {
+	X509       *cert;
+	const char *var;
+	uint32_t    index;
+	char       *cn;
+} TrustAnchor;
+
+/* Parse the certificates of the lists into "anchors", which has room for
+ * all the keys, and add them to the store if there is one. Returns the
+ * number of anchors. */
+static uint32_t
+load_trust_anchors (const EfiVarEntry *vars, MokListNode **lists,
+		    const uint32_t *node_nums, unsigned int var_num,
+		    TrustAnchor *anchors, X509_STORE *store)
+{
+	uint32_t anchor_num = 0;
+
+	for (unsigned int i = 0; i < var_num; i++) {
+		for (uint32_t n = 0; n < node_nums[i]; n++) {
+			const unsigned char *der = lists[i][n].mok;
+			TrustAnchor *anchor = &anchors[anchor_num];
+
+			if (efi_guid_cmp (&lists[i][n].header->SignatureType,
+					  &efi_guid_x509_cert) != 0)
+				continue;
+
+			anchor->cert = d2i_X509 (NULL, &der, lists[i][n].mok_size);
+			if (!anchor->cert)
+				continue;
+			if (store)
+				X509_STORE_add_cert (store, anchor->cert);
+			anchor->var = vars[i].name;
+			anchor->index = n + 1;
+			anchor->cn = get_subject_cn (lists[i][n].mok,
+						     lists[i][n].mok_size);
+			anchor_num++;
+		}
+	}
+
+	return anchor_num;
+}
+
+static void
+free_trust_anchors (TrustAnchor *anchors, uint32_t anchor_num)
+{
+	if (!anchors)
+		return;
+
+	for (uint32_t i = 0; i < anchor_num; i++) {
+		X509_free (anchors[i].cert);
+		free (anchors[i].cn);
+	}
+	free (anchors);
+}
+
+/* The outcomes of --verify-image, from the worst to the best, except
+ * that a revoked image stays revoked */
+typedef enum {
+	VERIFY_UNSIGNED = 0,
+	VERIFY_BAD_SIGNATURE,
+	VERIFY_BAD_DIGEST,
+	VERIFY_UNTRUSTED,
+	VERIFY_HASH_ALLOWED,
+	VERIFY_TRUSTED,
+	VERIFY_REVOKED,
+} VerifyResult;
+
+/* An image checked by --verify-image */
+typedef struct {
+	const char        *file;
+	int                err;
+	VerifyResult       result;
+	uint32_t           revoked;	/* the revocation checks it fails */
+	char              *cn;		/* the signer, or the revoked certificate */
+	const TrustAnchor *anchor;
+	DBName             hash_db;	/* where the hash of the image is allowed */
+	int                verify_err;
+} VerifyImage;
+
+typedef struct {
+	VerifyImage           *images;
+	const RequestSnapshot *snap;
+	X509_STORE            *store;
+	TrustAnchor           *anchors;
+	uint32_t               anchor_num;
+	const DBName          *dbs;
+	MokListNode          **lists;
+	uint32_t              *node_nums;
+	unsigned int           list_num;
+	int                    sha1;
+	unsigned int           trusted;
+	unsigned int           failed;
+} ImageVerify;
+
+/* Return the revocation checks a certificate fails, with its CN */
+static uint32_t
+cert_revocation (const RequestSnapshot *snap, X509 *cert, char **cn)
+{
+	unsigned char *der = NULL;
+	uint32_t revoked;
+	int len;
+
+	len = i2d_X509 (cert, &der);
+	if (len <= 0)
+		return 0;
+
+	revoked = request_check_mask (snap, &efi_guid_x509_cert, der, len);
+	if (revoked && cn)
+		*cn = get_subject_cn (der, len);
+	OPENSSL_free (der);
+
+	return revoked;
+}
+
+static char *
+x509_subject_cn (X509 *cert)
+{
+	unsigned char *der = NULL;
+	char *cn;
+	int len;
+
+	len = i2d_X509 (cert, &der);
+	if (len <= 0)
+		return NULL;
+
+	cn = get_subject_cn (der, len);
+	OPENSSL_free (der);
+
+	return cn;
+}
+
+/* Mark the image revoked if the certificate is */
+static int
+revoke_image (const ImageVerify *verify, VerifyImage *image, X509 *cert)
+{
+	uint32_t revoked;
+	char *cn = NULL;
+
+	revoked = cert_revocation (verify->snap, cert, &cn);
+	if (!revoked)
+		return 0;
+
+	free (image->cn);
+	image->cn = cn;
+	image->revoked = revoked;
+	image->result = VERIFY_REVOKED;
+
+	return 1;
+}
+
+static void
+set_verify_result (VerifyImage *image, VerifyResult result)
+{
+	if (result > image->result)
+		image->result = result;
+}
+
+/* Check that the SpcIndirectDataContent of an Authenticode signature has
+ * the digest of the image, and return its DER content, which is what the
+ * signer signed */
+static int
+check_signed_digest (const pe_image_t *pe, PKCS7 *p7, const uint8_t **content,
+		     size_t *content_size)
+{
+	const uint8_t *ptr;
+	const ASN1_OCTET_STRING *signed_digest;
+	const X509_ALGOR *alg;
+	const ASN1_OBJECT *obj;
+	const ASN1_STRING *seq;
+	const EVP_MD *md;
+	uint8_t digest[EVP_MAX_MD_SIZE];
+	unsigned int digest_size;
+	X509_SIG *digest_info;
+	PKCS7 *contents;
+	size_t len;
+	uint8_t tag;
+	int hdr, ret = -1;
+
+	contents = p7->d.sign->contents;
+	if (!contents || PKCS7_type_is_data (contents) ||
+	    !contents->d.other || contents->d.other->type != V_ASN1_SEQUENCE)
+		return -1;
+	seq = contents->d.other->value.sequence;
+
+	/* SpcIndirectDataContent ::= SEQUENCE { data, messageDigest } */
+	hdr = der_read_header (seq->data, seq->length, &tag, content_size);
+	if (hdr < 0 || tag != 0x30)
+		return -1;
+	*content = seq->data + hdr;
+
+	hdr = der_read_header (*content, *content_size, &tag, &len);
+	if (hdr < 0)
+		return -1;
+	ptr = *content + hdr + len;
+
+	/* messageDigest is a DigestInfo */
+	digest_info = d2i_X509_SIG (NULL, &ptr,
+				    *content + *content_size - ptr);
+	if (!digest_info)
+		return -1;
+	X509_SIG_get0 (digest_info, &alg, &signed_digest);
+	X509_ALGOR_get0 (&obj, NULL, NULL, alg);
+
+	md = EVP_get_digestbyobj (obj);
+	if (md && pe_image_digest (pe, md, digest, &digest_size) == 0 &&
+	    (int)digest_size == ASN1_STRING_length (signed_digest) &&
+	    memcmp (digest, ASN1_STRING_get0_data (signed_digest),
+		    digest_size) == 0)
+		ret = 0;
+
+	X509_SIG_free (digest_info);
+
+	return ret;
+}
+
+/* Verify one signature of an image the way shim does: its certificates
+ * must not be revoked, it must have the digest of the image, and its
+ * signer must chain to a certificate of db or MokListRT. Expiry is not
+ * checked, as the firmware has no trusted time. */
+static void
+verify_signature (ImageVerify *verify, VerifyImage *image,
+		  const pe_image_t *pe, const uint8_t *sig, uint32_t sig_size)
+{
+	const unsigned char *ptr = sig;
+	STACK_OF(X509) *certs, *signers = NULL, *chain;
+	X509_STORE_CTX *ctx = NULL;
+	const uint8_t *content;
+	size_t content_size;
+	BIO *bio = NULL;
+	X509 *anchor;
+	PKCS7 *p7;
+
+	p7 = d2i_PKCS7 (NULL, &ptr, sig_size);
+	if (!p7 || !PKCS7_type_is_signed (p7) || !p7->d.sign) {
+		set_verify_result (image, VERIFY_BAD_SIGNATURE);
+		goto out;
+	}
+
+	certs = p7->d.sign->cert;
+	for (int i = 0; i < sk_X509_num (certs); i++) {
+		if (revoke_image (verify, image, sk_X509_value (certs, i)))
+			goto out;
+	}
+
+	if (check_signed_digest (pe, p7, &content, &content_size) < 0) {
+		set_verify_result (image, VERIFY_BAD_DIGEST);
+		goto out;
+	}
+
+	/* The signature over the content only, the chain is built below to
+	 * find the trust anchor */
+	bio = BIO_new_mem_buf (content, content_size);
+	if (!bio || PKCS7_verify (p7, NULL, NULL, bio, NULL,
+				  PKCS7_BINARY | PKCS7_NOVERIFY) != 1) {
+		set_verify_result (image, VERIFY_BAD_SIGNATURE);
+		goto out;
+	}
+
+	/* A trusted signature was found already */
+	if (image->result >= VERIFY_TRUSTED)
+		goto out;
+
+	signers = PKCS7_get0_signers (p7, NULL, 0);
+	ctx = X509_STORE_CTX_new ();
+	if (!signers || sk_X509_num (signers) == 0 || !ctx ||
+	    !X509_STORE_CTX_init (ctx, verify->store, sk_X509_value (signers, 0),
+				  certs)) {
+		set_verify_result (image, VERIFY_BAD_SIGNATURE);
+		goto out;
+	}
+
+	if (X509_verify_cert (ctx) != 1) {
+		if (image->result < VERIFY_UNTRUSTED)
+			image->verify_err = X509_STORE_CTX_get_error (ctx);
+		set_verify_result (image, VERIFY_UNTRUSTED);
+		goto out;
+	}
+
+	/* The anchors in db or MokListRT may be revoked as well */
+	chain = X509_STORE_CTX_get0_chain (ctx);
+	for (int i = 0; i < sk_X509_num (chain); i++) {
+		if (revoke_image (verify, image, sk_X509_value (chain, i)))
+			goto out;
+	}
+
+	anchor = sk_X509_value (chain, sk_X509_num (chain) - 1);
+	for (uint32_t i = 0; i < verify->anchor_num; i++) {
+		if (X509_cmp (anchor, verify->anchors[i].cert) == 0) {
+			image->anchor = &verify->anchors[i];
+			break;
+		}
+	}
+	image->cn = x509_subject_cn (sk_X509_value (signers, 0));
+	image->result = VERIFY_TRUSTED;
+out:
+	X509_STORE_CTX_free (ctx);
+	sk_X509_free (signers);
+	BIO_free (bio);
+	PKCS7_free (p7);
+}
+
+static void
+verify_image (void *ctx, unsigned int index)
+{
+	ImageVerify *verify = ctx;
+	VerifyImage *image = &verify->images[index];
+	uint8_t sha256[SHA256_DIGEST_LENGTH];
+	uint8_t sha1[SHA_DIGEST_LENGTH];
+	const uint8_t *sig;
+	uint32_t sig_size, pos = 0;
+	pe_image_t pe;
+
+	if (pe_image_open (&pe, image->file) < 0) {
+		image->err = errno;
+		return;
+	}
+
+	if (pe_image_digest (&pe, EVP_sha256 (), sha256, NULL) < 0) {
+		image->err = errno ? errno : EIO;
+		goto out;
+	}
+	image->revoked = match_hash_index (verify->snap, sha256,
+					   SHA256_DIGEST_LENGTH, 0);
+	if (verify->sha1 && pe_image_digest (&pe, EVP_sha1 (), sha1, NULL) == 0)
+		image->revoked |= match_hash_index (verify->snap, sha1,
+						    SHA_DIGEST_LENGTH, 0);
+	if (image->revoked) {
+		image->result = VERIFY_REVOKED;
+		goto out;
+	}
+
+	while (image->result != VERIFY_REVOKED &&
+	       pe_image_next_signature (&pe, &pos, &sig, &sig_size))
+		verify_signature (verify, image, &pe, sig, sig_size);
+
+	if (image->result >= VERIFY_HASH_ALLOWED)
+		goto out;
+
+	/* shim also accepts an image by its hash */
+	for (unsigned int i = 0; i < verify->list_num; i++) {
+		if (verify->lists[i] &&
+		    list_contains (verify->lists[i], verify->node_nums[i],
+				   &efi_guid_sha256, sha256,
+				   SHA256_DIGEST_LENGTH)) {
+			image->hash_db = verify->dbs[i];
+			image->result = VERIFY_HASH_ALLOWED;
+			break;
+		}
+	}
+out:
+	pe_image_close (&pe);
+}
+
+static void
+print_verify_image (void *ctx, unsigned int index)
+{
+	ImageVerify *verify = ctx;
+	VerifyImage *image = &verify->images[index];
+
+	if (image->err == ENOEXEC) {
+		fprintf (stderr, "%s is not a valid PE/COFF image\n", image->file);
+		verify->failed++;
+		return;
+	} else if (image->err) {
+		errno = image->err;
+		fprintf (stderr, "Failed to read %s: %m\n", image->file);
+		verify->failed++;
+		return;
+	}
+
+	switch (image->result) {
+	case VERIFY_TRUSTED:
+		printf ("%s: trusted, signed by %s", image->file,
+			image->cn ? image->cn : "");
+		if (image->anchor)
+			printf (" via %s [key %u] %s",
+				image->anchor->var,
+				image->anchor->index,
+				image->anchor->cn ? image->anchor->cn : "");
+		printf ("\n");
+		verify->trusted++;
+		break;
+	case VERIFY_HASH_ALLOWED:
+		printf ("%s: trusted, its hash is in %s\n", image->file,
+			db_var_name[image->hash_db]);
+		verify->trusted++;
+		break;
+	case VERIFY_REVOKED:
+		if (image->cn)
+			printf ("%s: revoked, %s is revoked by", image->file,
+				image->cn);
+		else
+			printf ("%s: revoked, its hash is revoked by",
+				image->file);
+		print_check_names (verify->snap, image->revoked);
+		printf ("\n");
+		break;
+	case VERIFY_UNTRUSTED:
+		printf ("%s: not trusted, %s\n", image->file,
+			X509_verify_cert_error_string (image->verify_err));
+		break;
+	case VERIFY_BAD_DIGEST:
+		printf ("%s: not trusted, the signature doesn't match the image\n",
+			image->file);
+		break;
+	case VERIFY_BAD_SIGNATURE:
+		printf ("%s: not trusted, invalid signature\n", image->file);
+		break;
+	case VERIFY_UNSIGNED:
+		printf ("%s: not trusted, not signed\n", image->file);
+		break;
+	}
+}
+
+/* Tell whether shim would boot the images: every certificate of db and
+ * MokListRT goes to a single trust store shared by the workers, and dbx
+ * and MokListXRT are read once. Returns 1 if any image isn't trusted. */
+static int
+verify_images (char **files, uint32_t total)
+{
+	const DBName trusted_dbs[] = { DB, MOK_LIST_RT };
+	unsigned int var_num = sizeof(trusted_dbs)/sizeof(trusted_dbs[0]);
+	EfiVarEntry vars[sizeof(trusted_dbs)/sizeof(trusted_dbs[0])];
+	MokListNode *lists[sizeof(trusted_dbs)/sizeof(trusted_dbs[0])] = {NULL};
+	uint32_t node_nums[sizeof(trusted_dbs)/sizeof(trusted_dbs[0])] = {0};
+	RequestSnapshot snap;
+	ImageVerify verify;
+	uint32_t anchor_num = 0;
+	int ret = -1;
+
+	if (!files)
+		return -1;
+
+	memset (&verify, 0, sizeof(verify));
+	for (unsigned int i = 0; i < var_num; i++) {
+		vars[i].guid = db_var_guid[trusted_dbs[i]];
+		vars[i].name = db_var_name[trusted_dbs[i]];
+	}
+	read_var_entries (vars, var_num);
+	if (load_revocation_snapshot (&snap) < 0)
+		goto error;
+
+	for (unsigned int i = 0; i < snap.num; i++) {
+		if (snap.vars[i].err && snap.vars[i].err != ENOENT) {
+			errno = snap.vars[i].err;
+			fprintf (stderr, "Failed to read %s: %m\n",
+				 snap.vars[i].name);
+			goto error;
+		}
+	}
+
+	if (build_var_lists (vars, var_num, lists, node_nums, &anchor_num) < 0)
+		goto error;
+
+	verify.store = X509_STORE_new ();
+	verify.anchors = calloc (anchor_num + 1, sizeof(TrustAnchor));
+	verify.images = calloc (total, sizeof(VerifyImage));
+	if (!verify.store || !verify.anchors || !verify.images) {
+		fprintf (stderr, "Failed to allocate space: %m\n");
+		goto error;
+	}
+	/* shim ignores the validity and the key usage of the certificates,
+	 * and any certificate in the chain can be the anchor */
+	X509_STORE_set_flags (verify.store, X509_V_FLAG_PARTIAL_CHAIN |
+					    X509_V_FLAG_NO_CHECK_TIME);
+	X509_STORE_set_purpose (verify.store, X509_PURPOSE_ANY);
+
+	verify.anchor_num = load_trust_anchors (vars, lists, node_nums, var_num,
+						verify.anchors, verify.store);
+
+	for (uint32_t i = 0; i < snap.hash_index_num; i++) {
+		if (!snap.hash_index[i].tbs &&
+		    snap.hash_index[i].size == SHA_DIGEST_LENGTH)
+			verify.sha1 = 1;
+	}
+
+	for (uint32_t i = 0; i < total; i++)
+		verify.images[i].file = files[i];
+	verify.snap = &snap;
+	verify.dbs = trusted_dbs;
+	verify.lists = lists;
+	verify.node_nums = node_nums;
+	verify.list_num = var_num;
+
+	run_parallel (total, verify_image, print_verify_image, &verify);
+
+	if (verify.failed)
+		ret = -1;
+	else
+		ret = verify.trusted < total;
+error:
+	if (verify.images) {
+		for (uint32_t i = 0; i < total; i++)
+			free (verify.images[i].cn);
+		free (verify.images);
+	}
+	free_trust_anchors (verify.anchors, verify.anchor_num);
+	X509_STORE_free (verify.store);
+	for (unsigned int i = 0; i < var_num; i++)
+		free (lists[i]);
+	free_var_entries (vars, var_num);
+	free_request_snapshot (&snap);
+
+	return ret;
+}
+
+extern char **environ;
+
+#define MODULE_SIG_MAGIC "~Module signature appended~\n"
+#define MODULE_SIG_INFO_SIZE 12
+#define MODULE_SIG_TAIL (64 * 1024)
+#define PKEY_ID_PKCS7 2
+
+/* The module suffixes, and the programs that decompress them */
+static const struct {
+	const char *suffix;
+	const char *prog;
+} module_types[] = {
+	{ ".ko",     NULL    },
+	{ ".ko.xz",  "xz"    },
+	{ ".ko.zst", "zstd"  },
+	{ ".ko.gz",  "gzip"  },
+};
+
+typedef enum {
+	MODULE_TRUSTED = 0,
+	MODULE_UNSIGNED,
+	MODULE_BAD_SIGNATURE,
+	MODULE_UNTRUSTED,
+	MODULE_REVOKED,
+	MODULE_UNREADABLE,
+} ModuleState;
+
+/* A module checked by --scan-modules */
+typedef struct {
+	const char        *file;
+	const char        *prog;
+	ModuleState        state;
+	int                err;		/* 0 if it failed to decompress */
+	const TrustAnchor *anchor;
+	char              *signer;	/* the signer id if it isn't enrolled */
+} ModuleScan;
+
+typedef struct {
+	ModuleScan            *modules;
+	const RequestSnapshot *snap;
+	const TrustAnchor     *anchors;
+	const uint32_t        *revoked;	/* by anchor */
+	uint32_t               anchor_num;
+	unsigned int           scanned;
+	unsigned int           untrusted;
+	unsigned int           failed;
+} ModuleScanCtx;
+
+/* Return the decompressor of a module, "" if it isn't compressed, or NULL
+ * if the file isn't a module */
+static const char *
+module_prog (const char *file)
+{
+	size_t len = strlen (file), suffix_len;
+
+	for (unsigned int i = 0; i < sizeof(module_types)/sizeof(module_types[0]); i++) {
+		suffix_len = strlen (module_types[i].suffix);
+		if (len > suffix_len &&
+		    strcmp (file + len - suffix_len, module_types[i].suffix) == 0)
+			return module_types[i].prog ? module_types[i].prog : "";
+	}
+
+	return NULL;
+}
+
+/* Read the end of a module, where the signature is, into "tail" which has
+ * room for twice MODULE_SIG_TAIL. A compressed module is streamed through
+ * its decompressor and only the end is kept. Returns -2 if the
+ * decompressor can't be run or fails. */
+static int
+read_module_tail (const ModuleScan *module, uint8_t *tail, size_t *tail_size)
+{
+	posix_spawn_file_actions_t actions;
+	char *argv[] = { (char *)module->prog, (char *)"-dc",
+			 (char *)module->file, NULL };
+	struct stat st;
+	size_t len = 0;
+	ssize_t n;
+	off_t offset;
+	pid_t pid;
+	int fds[2], status, err = 0, ret = -1;
+
+	if (module->prog[0] == '\0') {
+		fds[0] = open (module->file, O_RDONLY);
+		if (fds[0] < 0)
+			return -1;
+		if (fstat (fds[0], &st) < 0) {
+			err = errno;
+			goto close;
+		}
+		offset = st.st_size > MODULE_SIG_TAIL ? st.st_size - MODULE_SIG_TAIL : 0;
+		while ((n = pread (fds[0], tail + len, MODULE_SIG_TAIL - len,
+				   offset + len)) != 0) {
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				err = errno;
+				break;
+			}
+			len += n;
+			if (len == MODULE_SIG_TAIL)
+				break;
+		}
+		goto close;
+	}
+
+	/* Keep the pipe out of the decompressors of the other workers. It
+	 * has to be atomic, as they may be spawned at any time. */
+	if (pipe2 (fds, O_CLOEXEC) < 0)
+		return -1;
+
+	posix_spawn_file_actions_init (&actions);
+	posix_spawn_file_actions_adddup2 (&actions, fds[1], STDOUT_FILENO);
+	posix_spawn_file_actions_addopen (&actions, STDERR_FILENO, "/dev/null",
+					  O_WRONLY, 0);
+	err = posix_spawnp (&pid, module->prog, &actions, NULL, argv, environ);
+	posix_spawn_file_actions_destroy (&actions);
+	close (fds[1]);
+	if (err) {
+		ret = -2;
+		goto close;
+	}
+
+	while ((n = read (fds[0], tail + len, 2 * MODULE_SIG_TAIL - len)) != 0) {
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			err = errno;
+			break;
+		}
+		len += n;
+		if (len == 2 * MODULE_SIG_TAIL) {
+			memmove (tail, tail + MODULE_SIG_TAIL, MODULE_SIG_TAIL);
+			len = MODULE_SIG_TAIL;
+		}
+	}
+	close (fds[0]);
+	fds[0] = -1;
+
+	while (waitpid (pid, &status, 0) < 0) {
+		if (errno != EINTR) {
+			status = -1;
+			break;
+		}
+	}
+	if (!err && (!WIFEXITED(status) || WEXITSTATUS(status) != 0)) {
+		err = EIO;
+		ret = -2;
+	}
+close:
+	if (fds[0] >= 0)
+		close (fds[0]);
+	if (err) {
+		errno = err;
+		return ret;
+	}
+	*tail_size = len;
+
+	return 0;
+}
+
+/* Describe a signer that isn't enrolled by its issuer and serial, or by
+ * its subject key identifier */
+static char *
+describe_signer (CMS_SignerInfo *si)
+{
+	ASN1_OCTET_STRING *keyid = NULL;
+	X509_NAME *issuer = NULL;
+	ASN1_INTEGER *serial = NULL;
+	const ASN1_STRING *id;
+	char *name = NULL, *desc;
+	size_t size;
+	int len;
+
+	if (!CMS_SignerInfo_get0_signer_id (si, &keyid, &issuer, &serial))
+		return NULL;
+
+	id = keyid ? keyid : serial;
+	if (!id)
+		return NULL;
+	if (issuer)
+		name = X509_NAME_oneline (issuer, NULL, 0);
+
+	len = ASN1_STRING_length (id);
+	size = (name ? strlen (name) : 0) + 2 * len + 32;
+	desc = malloc (size);
+	if (desc) {
+		const unsigned char *data = ASN1_STRING_get0_data (id);
+		char *ptr = desc;
+
+		if (keyid)
+			ptr += sprintf (ptr, "key id ");
+		else
+			ptr += sprintf (ptr, "issuer %s, serial ", name ? name : "");
+		for (int i = 0; i < len; i++)
+			ptr += sprintf (ptr, "%02x", data[i]);
+	}
+	OPENSSL_free (name);
+
+	return desc;
+}
+
+static void
+scan_module (void *ctx, unsigned int index)
+{
+	ModuleScanCtx *scan = ctx;
+	ModuleScan *module = &scan->modules[index];
+	const size_t magic_len = sizeof(MODULE_SIG_MAGIC) - 1;
+	STACK_OF(CMS_SignerInfo) *infos;
+	CMS_SignerInfo *si;
+	CMS_ContentInfo *cms = NULL;
+	const unsigned char *ptr;
+	const uint8_t *info;
+	uint8_t *tail;
+	size_t tail_size;
+	uint32_t sig_len;
+	int rc;
+
+	tail = malloc (2 * MODULE_SIG_TAIL);
+	if (!tail) {
+		module->err = errno;
+		module->state = MODULE_UNREADABLE;
+		return;
+	}
+
+	rc = read_module_tail (module, tail, &tail_size);
+	if (rc < 0) {
+		module->err = rc == -2 ? 0 : errno;
+		module->state = MODULE_UNREADABLE;
+		free (tail);
+		return;
+	}
+
+	if (tail_size < magic_len ||
+	    memcmp (tail + tail_size - magic_len, MODULE_SIG_MAGIC, magic_len) != 0) {
+		module->state = MODULE_UNSIGNED;
+		goto out;
+	}
+
+	/* struct module_signature is in front of the magic string, and the
+	 * PKCS#7 signature in front of it */
+	module->state = MODULE_BAD_SIGNATURE;
+	if (tail_size < magic_len + MODULE_SIG_INFO_SIZE)
+		goto out;
+	info = tail + tail_size - magic_len - MODULE_SIG_INFO_SIZE;
+	sig_len = (uint32_t)info[8] << 24 | info[9] << 16 | info[10] << 8 | info[11];
+	if (info[2] != PKEY_ID_PKCS7 ||
+	    sig_len > tail_size - magic_len - MODULE_SIG_INFO_SIZE)
+		goto out;
+
+	ptr = info - sig_len;
+	cms = d2i_CMS_ContentInfo (NULL, &ptr, sig_len);
+	infos = cms ? CMS_get0_SignerInfos (cms) : NULL;
+	if (!infos || sk_CMS_SignerInfo_num (infos) == 0)
+		goto out;
+	si = sk_CMS_SignerInfo_value (infos, 0);
+
+	for (uint32_t i = 0; i < scan->anchor_num; i++) {
+		if (CMS_SignerInfo_cert_cmp (si, scan->anchors[i].cert) == 0) {
+			module->anchor = &scan->anchors[i];
+			module->state = scan->revoked[i] ? MODULE_REVOKED :
+							   MODULE_TRUSTED;
+			goto out;
+		}
+	}
+
+	module->signer = describe_signer (si);
+	module->state = MODULE_UNTRUSTED;
+out:
+	CMS_ContentInfo_free (cms);
+	free (tail);
+}
+
+static void
+print_scan_module (void *ctx, unsigned int index)
+{
+	ModuleScanCtx *scan = ctx;
+	ModuleScan *module = &scan->modules[index];
+	const TrustAnchor *anchor = module->anchor;
+	static const char *reasons[] = {
+		[MODULE_UNSIGNED] = "unsigned",
+		[MODULE_BAD_SIGNATURE] = "invalid_signature",
+		[MODULE_UNTRUSTED] = "unknown_key",
+		[MODULE_REVOKED] = "revoked",
+	};
+
+	if (module->state == MODULE_UNREADABLE) {
+		if (module->err == 0)
+			fprintf (stderr, "Failed to decompress %s with %s\n",
+				 module->file, module->prog);
+		else
+			fprintf (stderr, "Failed to read %s: %s\n", module->file,
+				 strerror (module->err));
+		scan->failed++;
+		return;
+	}
+	scan->scanned++;
+
+	if (module->state == MODULE_TRUSTED)
+		return;
+
+	if (output_format == OUTPUT_JSON) {
+		printf ("%s\n{\"file\":", scan->untrusted > 0 ? "," : "");
+		json_print_string (stdout, module->file);
+		printf (",\"reason\":\"%s\",\"signer\":", reasons[module->state]);
+		json_print_string (stdout, anchor ? anchor->cn : module->signer);
+		if (anchor) {
+			printf (",\"database\":\"%s\",\"index\":%u,\"revoked_by\":",
+				anchor->var, anchor->index);
+			print_check_names (scan->snap,
+					   scan->revoked[anchor - scan->anchors]);
+		}
+		printf ("}");
+	} else {
+		switch (module->state) {
+		case MODULE_UNSIGNED:
+			printf ("%s: not signed\n", module->file);
+			break;
+		case MODULE_BAD_SIGNATURE:
+			printf ("%s: invalid signature\n", module->file);
+			break;
+		case MODULE_UNTRUSTED:
+			printf ("%s: signed by a key that isn't enrolled, %s\n",
+				module->file, module->signer ? module->signer : "");
+			break;
+		case MODULE_REVOKED:
+			printf ("%s: signed by %s [key %u] %s, revoked by",
+				module->file, anchor->var, anchor->index,
+				anchor->cn ? anchor->cn : "");
+			print_check_names (scan->snap,
+					   scan->revoked[anchor - scan->anchors]);
+			printf ("\n");
+			break;
+		default:
+			break;
+		}
+	}
+	scan->untrusted++;
+}
+
+/* Check that the kernel modules under a directory, compressed or not,
+ * are signed by a key of MokListRT or db, or one pending in MokNew, that
+ * dbx and MokListXRT don't revoke. Only the signer is matched, the
+ * signature itself is left to the kernel. Returns 1 if any isn't. */
+static int
+scan_modules (const char *dir)
+{
+	const struct {
+		const efi_guid_t *guid;
+		const char *name;
+	} trusted_vars[] = {
+		{ &efi_guid_shim, "MokListRT" },
+		{ &efi_guid_security, "db" },
+		{ &efi_guid_shim, "MokNew" },
+	};
+	unsigned int var_num = sizeof(trusted_vars)/sizeof(trusted_vars[0]);
+	EfiVarEntry vars[sizeof(trusted_vars)/sizeof(trusted_vars[0])];
+	MokListNode *lists[sizeof(trusted_vars)/sizeof(trusted_vars[0])] = {NULL};
+	uint32_t node_nums[sizeof(trusted_vars)/sizeof(trusted_vars[0])] = {0};
+	RequestSnapshot snap;
+	ModuleScanCtx scan;
+	TrustAnchor *anchors = NULL;
+	uint32_t *revoked = NULL;
+	uint32_t anchor_num = 0, total = 0, module_num = 0;
+	char **files = NULL;
+	int ret = -1;
+
+	memset (&scan, 0, sizeof(scan));
+	for (unsigned int i = 0; i < var_num; i++) {
+		vars[i].guid = trusted_vars[i].guid;
+		vars[i].name = trusted_vars[i].name;
+	}
+	read_var_entries (vars, var_num);
+	if (load_revocation_snapshot (&snap) < 0)
+		goto error;
+
+	for (unsigned int i = 0; i < snap.num; i++) {
+		if (snap.vars[i].err && snap.vars[i].err != ENOENT) {
+			errno = snap.vars[i].err;
+			fprintf (stderr, "Failed to read %s: %m\n",
+				 snap.vars[i].name);
+			goto error;
+		}
+	}
+
+	if (build_var_lists (vars, var_num, lists, node_nums, &anchor_num) < 0)
+		goto error;
+
+	anchors = calloc (anchor_num + 1, sizeof(TrustAnchor));
+	revoked = calloc (anchor_num + 1, sizeof(uint32_t));
+	if (!anchors || !revoked) {
+		fprintf (stderr, "Failed to allocate space: %m\n");
+		goto error;
+	}
+	anchor_num = load_trust_anchors (vars, lists, node_nums, var_num,
+					 anchors, NULL);
+	for (uint32_t i = 0; i < anchor_num; i++)
+		revoked[i] = cert_revocation (&snap, anchors[i].cert, NULL);
+
+	if (collect_dir_files (dir, NULL, &files, &total) < 0)
+		goto error;
+
+	scan.modules = calloc (total + 1, sizeof(ModuleScan));
+	if (!scan.modules) {
+		fprintf (stderr, "Failed to allocate space: %m\n");
+		goto error;
+	}
+	for (uint32_t i = 0; i < total; i++) {
+		const char *prog = module_prog (files[i]);
+
+		if (!prog)
+			continue;
+		scan.modules[module_num].file = files[i];
+		scan.modules[module_num].prog = prog;
+		module_num++;
+	}
+	scan.snap = &snap;
+	scan.anchors = anchors;
+	scan.revoked = revoked;
+	scan.anchor_num = anchor_num;
+
+	if (output_format == OUTPUT_JSON)
+		printf ("{\"untrusted\":[");
+
+	run_parallel (module_num, scan_module, print_scan_module, &scan);
+
+	if (output_format == OUTPUT_JSON)
+		printf ("\n],\"scanned\":%u}\n", scan.scanned);
+	else
+		printf ("%u module(s) scanned, %u not trusted\n", scan.scanned,
+			scan.untrusted);
+
+	ret = scan.failed ? -1 : scan.untrusted > 0;
+error:
+	if (scan.modules) {
+		for (uint32_t i = 0; i < module_num; i++)
+			free (scan.modules[i].signer);
+		free (scan.modules);
+	}
+	if (files) {
+		for (uint32_t i = 0; i < total; i++)
+			free (files[i]);
+		free (files);
+	}
+	free_trust_anchors (anchors, anchor_num);
+	free (revoked);
+	for (unsigned int i = 0; i < var_num; i++)
+		free (lists[i]);
+	free_var_entries (vars, var_num);
+	free_request_snapshot (&snap);
+
+	return ret;
+}
+
+/* List the certificates of every database that expire within "days",
+ * or have expired. Only the validity of the certificates is decoded.
+ * Returns 1 if any is listed. */
+static int
+expiring_keys (unsigned long days)
+{
+	EfiVarEntry vars[DB_NUM];
+	MokListNode *lists[DB_NUM] = {NULL};
+	uint32_t node_nums[DB_NUM] = {0};
+	uint32_t node_total, checked = 0, listed = 0;
+	time_t now, limit, not_before, not_after;
+	uint8_t sha256[SHA256_DIGEST_LENGTH];
+	char date[32];
+	struct tm tm;
+	char *cn;
+	int ret = -1;
+
+	for (unsigned int i = 0; i < DB_NUM; i++) {
+		vars[i].guid = db_var_guid[i];
+		vars[i].name = db_var_name[i];
+	}
+	read_var_entries (vars, DB_NUM);
+	if (build_var_lists (vars, DB_NUM, lists, node_nums, &node_total) < 0)
+		goto error;
+
+	now = time (NULL);
+	limit = now + (time_t)days * 24 * 60 * 60;
+
+	if (output_format == OUTPUT_JSON)
+		printf ("{\"expiring\":[");
+
+	for (unsigned int i = 0; i < DB_NUM; i++) {
+		for (uint32_t n = 0; n < node_nums[i]; n++) {
+			const MokListNode *node = &lists[i][n];
+
+			if (efi_guid_cmp (&node->header->SignatureType,
+					  &efi_guid_x509_cert) != 0)
+				continue;
+			checked++;
+
+			if (der_cert_validity (node->mok, node->mok_size,
+					       &not_before, &not_after) < 0) {
+				fprintf (stderr, "Failed to decode the validity of %s [key %u]\n",
+					 vars[i].name, n + 1);
+				continue;
+			}
+			if (not_after > limit)
+				continue;
+
+			/* Only the listed ones need more than the validity */
+			SHA256 (node->mok, node->mok_size, sha256);
+			cn = get_subject_cn (node->mok, node->mok_size);
+			gmtime_r (&not_after, &tm);
+			strftime (date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", &tm);
+
+			if (output_format == OUTPUT_JSON) {
+				printf ("%s\n{\"database\":\"%s\",\"index\":%u,\"sha256\":",
+					listed > 0 ? "," : "", vars[i].name, n + 1);
+				json_print_hex (stdout, sha256, SHA256_DIGEST_LENGTH);
+				printf (",\"subject_cn\":");
+				json_print_string (stdout, cn);
+				printf (",\"not_after\":\"%s\",\"expired\":%s}", date,
+					not_after <= now ? "true" : "false");
+			} else {
+				printf ("%s [key %u] ", vars[i].name, n + 1);
+				print_sha256 (sha256);
+				printf (" %s: %s %s\n", cn ? cn : "",
+					not_after <= now ? "expired on" : "expires on",
+					date);
+			}
+			free (cn);
+			listed++;
+		}
+	}
+
+	if (output_format == OUTPUT_JSON)
+		printf ("\n],\"checked\":%u}\n", checked);
+	else
+		printf ("%u certificate(s) checked, %u expiring within %lu day(s)\n",
+			checked, listed, days);
+
+	ret = listed > 0;
+error:
+	for (unsigned int i = 0; i < DB_NUM; i++)
+		free (lists[i]);
+	free_var_entries (vars, DB_NUM);
+
+	return ret;
+}
+
+static int
+summarize_dbs ()
+{
+	uint8_t *data;
+	size_t data_size;
+	uint32_t attributes;
+	DBStats stats;
+	int ret = 0;
+
+	if (output_format == OUTPUT_JSON)
+		printf ("{\"databases\":[");
+
+	for (unsigned int i = 0; i < DB_NUM; i++) {
+		if (efi_get_variable (*db_var_guid[i], db_var_name[i], &data,
+				      &data_size, &attributes) < 0) {
+			if (errno != ENOENT) {
+				fprintf (stderr, "Failed to read %s: %m\n",
+					 db_var_name[i]);
+				ret = -1;
+			}
+			memset (&stats, 0, sizeof(stats));
+		} else {
+			count_signatures (data, data_size, &stats);
+			free (data);
+			if (stats.corrupted) {
+				fprintf (stderr, "Corrupted signature list in %s\n",
+					 db_var_name[i]);
+				ret = -1;
+			}
+		}
+
+		if (output_format == OUTPUT_JSON) {
+			printf ("%s\n{\"name\":\"%s\",\"present\":%s,\"bytes\":%zu,"
+				"\"largest\":%u,\"entries\":{", i > 0 ? "," : "",
+				db_var_name[i], stats.present ? "true" : "false",
+				stats.size, stats.largest);
+			for (unsigned int t = 0, n = 0; t < SIG_TYPE_NUM; t++) {
+				if (stats.count[t] == 0)
+					continue;
+				printf ("%s\"%s\":%lu", n++ > 0 ? "," : "",
+					sig_types[t].name,
+					(unsigned long)stats.count[t]);
+			}
+			printf ("},\"unknown\":%lu}", (unsigned long)stats.unknown);
+			continue;
+		}
+
+		if (!stats.present) {
+			printf ("%s is empty\n", db_var_name[i]);
+			continue;
+		}
+
+		printf ("%s: %zu bytes, largest entry %u bytes\n",
+			db_var_name[i], stats.size, stats.largest);
+		for (unsigned int t = 0; t < SIG_TYPE_NUM; t++) {
+			if (stats.count[t] == 0)
+				continue;
+			printf ("  %-12s %lu\n", sig_types[t].name,
+				(unsigned long)stats.count[t]);
+		}
+		if (stats.unknown)
+			printf ("  %-12s %lu\n", "unknown",
+				(unsigned long)stats.unknown);
+	}
+
+	if (output_format == OUTPUT_JSON)
+		printf ("\n]}\n");
+
+	return ret;
+}
+
+/* Write the raw signature lists of a database or a pending key request
+ * to a file or stdout, exactly as the firmware returned them */
+static int
+export_esl (const char *var_name, const char *file)
+{
+	const efi_guid_t *guid = NULL;
+	uint8_t *data = NULL;
+	size_t data_size = 0;
+	uint32_t attributes;
+	size_t offset = 0;
+	ssize_t write_size;
+	mode_t mode;
+	int fd = STDOUT_FILENO;
+	int ret = -1;
+
+	for (unsigned int i = 0; i < DB_NUM; i++) {
+		if (strcmp (var_name, db_var_name[i]) == 0)
+			guid = db_var_guid[i];
+	}
+	for (unsigned int i = 0; i < PENDING_KEY_LISTS; i++) {
+		if (strcmp (var_name, pending_var_names[i]) == 0)
+			guid = &efi_guid_shim;
+	}
+	if (!guid) {
+		fprintf (stderr, "%s is not a signature database\n", var_name);
+		return -1;
+	}
+
+	if (efi_get_variable (*guid, var_name, &data, &data_size,
+			      &attributes) < 0) {
+		if (errno == ENOENT) {
+			fprintf (stderr, "%s is empty\n", var_name);
+			return -1;
+		}
+		fprintf (stderr, "Failed to read %s: %m\n", var_name);
+		return -1;
+	}
+
+	if (file && strcmp (file, "-") != 0) {
+		/* mode 644 */
+		mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+		fd = open (file, O_CREAT | O_WRONLY | O_TRUNC, mode);
+		if (fd < 0) {
+			fprintf (stderr, "Failed to open %s: %m\n", file);
+			goto error;
+		}
+	} else if (isatty (STDOUT_FILENO)) {
+		fprintf (stderr, "Refusing to write %s to a terminal\n", var_name);
+		goto error;
+	}
+
+	/* Pass the variable through untouched */
+	while (offset < data_size) {
+		write_size = write (fd, data + offset, data_size - offset);
+		if (write_size < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf (stderr, "Failed to write %s: %m\n",
+				 fd == STDOUT_FILENO ? "stdout" : file);
+			goto error;
+		}
+		offset += write_size;
+	}
+
+	ret = 0;
+error:
+	if (fd != STDOUT_FILENO && fd >= 0 && close (fd) < 0 && ret == 0) {
+		fprintf (stderr, "Failed to write %s: %m\n", file);
+		ret = -1;
+	}
+	free (data);
+
+	return ret;
+}
+
+typedef enum {
+	POSTURE_SECUREBOOT,
+	POSTURE_SETUPMODE,
+	POSTURE_MOKSBSTATE,
+	POSTURE_TIMEOUT,
+	POSTURE_VERBOSITY,
+	POSTURE_PENDING,
+	POSTURE_DB = POSTURE_PENDING + PENDING_NUM,
+	POSTURE_VAR_NUM = POSTURE_DB + DB_NUM
+} PostureVar;
+
+#define POSTURE_KEY_VARS (PENDING_KEY_LISTS + DB_NUM)
+
+typedef struct {
+	EfiVarEntry  vars[POSTURE_VAR_NUM];
+	unsigned int key_vars[POSTURE_KEY_VARS];
+	char        *buf[POSTURE_KEY_VARS];
+	size_t       buf_size[POSTURE_KEY_VARS];
+} Posture;
+
+static void
+print_var_keys (FILE *fp, const EfiVarEntry *var, int optional, int first)
+{
+	OutputFormat format = output_format == OUTPUT_JSON ? OUTPUT_JSON :
+							     OUTPUT_SHORT;
+	MokListNode *list = NULL;
+	uint32_t mok_num = 0;
+
+	if (var->data) {
+		list = build_mok_list (var->data, var->size, &mok_num);
+		if (!list)
+			fprintf (stderr, "Corrupted signature list in %s\n",
+				 var->name);
+	}
+
+	if (format == OUTPUT_JSON) {
+		fprintf (fp, "%s\n{\"variable\":\"%s\",\"present\":%s,"
+			 "\"bytes\":%zu,\"valid\":%s,\"entries\":[",
+			 first ? "" : ",", var->name,
+			 var->data ? "true" : "false", var->size,
+			 !var->data || list ? "true" : "false");
+	} else if (!var->data) {
+		if (!optional)
+			fprintf (fp, "\n%s is empty\n", var->name);
+		return;
+	} else {
+		fprintf (fp, "\n%s: %u key(s), %zu bytes%s\n", var->name,
+			 mok_num, var->size, list ? "" : ", corrupted");
+	}
+
+	for (uint32_t i = 0; i < mok_num; i++)
+		print_key (fp, format, &list[i], i, i == 0, i == mok_num - 1);
+
+	if (format == OUTPUT_JSON)
+		fprintf (fp, "\n]}");
+
+	free (list);
+}
+
+static void
+render_var_keys (void *ctx, unsigned int index)
+{
+	Posture *posture = ctx;
+	FILE *fp;
+
+	fp = open_memstream (&posture->buf[index], &posture->buf_size[index]);
+	if (!fp) {
+		fprintf (stderr, "Failed to allocate buffer: %m\n");
+		posture->buf[index] = NULL;
+		return;
+	}
+
+	/* Only the pending requests that exist are worth mentioning */
+	print_var_keys (fp, &posture->vars[posture->key_vars[index]],
+			posture->key_vars[index] < POSTURE_DB, index == 0);
+	fclose (fp);
+}
+
+static void
+write_var_keys (void *ctx, unsigned int index)
+{
+	Posture *posture = ctx;
+
+	if (!posture->buf[index])
+		return;
+
+	fwrite (posture->buf[index], 1, posture->buf_size[index], stdout);
+	free (posture->buf[index]);
+}
+
+static int
+report_posture ()
+{
+	Posture posture;
+	EfiVarEntry *vars = posture.vars;
+	int32_t secureboot = -1, setupmode = -1, verbosity = -1;
+	int32_t timeout = 10;
+	int timeout_known = 1;
+	unsigned int n_pending = 0;
+	int ret = 0;
+
+	vars[POSTURE_SECUREBOOT].guid = &efi_guid_global;
+	vars[POSTURE_SECUREBOOT].name = "SecureBoot";
+	vars[POSTURE_SETUPMODE].guid = &efi_guid_global;
+	vars[POSTURE_SETUPMODE].name = "SetupMode";
+	vars[POSTURE_MOKSBSTATE].guid = &efi_guid_shim;
+	vars[POSTURE_MOKSBSTATE].name = "MokSBStateRT";
+	vars[POSTURE_TIMEOUT].guid = &efi_guid_shim;
+	vars[POSTURE_TIMEOUT].name = "MokTimeout";
+	vars[POSTURE_VERBOSITY].guid = &efi_guid_shim;
+	vars[POSTURE_VERBOSITY].name = "SHIM_VERBOSE";
+	for (unsigned int i = 0; i < PENDING_NUM; i++) {
+		vars[POSTURE_PENDING + i].guid = &efi_guid_shim;
+		vars[POSTURE_PENDING + i].name = pending_var_names[i];
+	}
+	for (unsigned int i = 0; i < DB_NUM; i++) {
+		vars[POSTURE_DB + i].guid = db_var_guid[i];
+		vars[POSTURE_DB + i].name = db_var_name[i];
+	}
 
-		if (!password) {
-			fprintf (stderr, "Failed to duplicate string\n");
-			return -1;
+	/* Every variable is read exactly once */
+	read_var_entries (vars, POSTURE_VAR_NUM);
+
+	for (unsigned int i = 0; i < POSTURE_VAR_NUM; i++) {
+		if (vars[i].err && vars[i].err != ENOENT) {
+			errno = vars[i].err;
+			fprintf (stderr, "Failed to read %s: %m\n", vars[i].name);
+			ret = -1;
 		}
+	}
+
+	if (vars[POSTURE_SECUREBOOT].data)
+		secureboot = decode_state_var ("SecureBoot",
+					       vars[POSTURE_SECUREBOOT].data,
+					       vars[POSTURE_SECUREBOOT].size);
+	if (vars[POSTURE_SETUPMODE].data)
+		setupmode = decode_state_var ("SetupMode",
+					      vars[POSTURE_SETUPMODE].data,
+					      vars[POSTURE_SETUPMODE].size);
+	/* shim waits 10 seconds unless MokTimeout says otherwise */
+	if (vars[POSTURE_TIMEOUT].data) {
+		if (vars[POSTURE_TIMEOUT].size == sizeof(int32_t))
+			timeout = *(int32_t *)vars[POSTURE_TIMEOUT].data;
+		else
+			timeout_known = 0;
+	}
+	if (vars[POSTURE_VERBOSITY].data && vars[POSTURE_VERBOSITY].size > 0)
+		verbosity = vars[POSTURE_VERBOSITY].data[0] != 0;
+	else if (!vars[POSTURE_VERBOSITY].data)
+		verbosity = 0;
+
+	if (output_format == OUTPUT_JSON) {
+		printf ("{\"secureboot\":");
+		json_print_bool (stdout, secureboot < 0 ? -1 : secureboot == 1 && setupmode == 0);
+		printf (",\"setup_mode\":");
+		json_print_bool (stdout, setupmode);
+		printf (",\"shim_validation_disabled\":");
+		json_print_bool (stdout, vars[POSTURE_MOKSBSTATE].data != NULL);
+		printf (",\"timeout\":");
+		if (timeout_known)
+			printf ("%d", timeout);
+		else
+			printf ("null");
+		printf (",\"verbose\":");
+		json_print_bool (stdout, verbosity);
+		printf (",\"pending\":[");
+		for (unsigned int i = 0; i < PENDING_NUM; i++) {
+			if (!vars[POSTURE_PENDING + i].data)
+				continue;
+			printf ("%s\"%s\"", n_pending++ > 0 ? "," : "",
+				pending_var_names[i]);
+		}
+		printf ("],\"variables\":[");
 	} else {
-		if (get_password (&password, &pw_len, PASSWORD_MIN, PASSWORD_MAX) < 0) {
-			fprintf (stderr, "Abort\n");
-			return -1;
+		if (secureboot == 1 && setupmode == 0) {
+			printf ("SecureBoot enabled\n");
+			if (vars[POSTURE_MOKSBSTATE].data)
+				printf ("SecureBoot validation is disabled in shim\n");
+		} else if (secureboot == 0 || setupmode == 1) {
+			printf ("SecureBoot disabled\n");
+			if (setupmode == 1)
+				printf ("Platform is in Setup Mode\n");
+		} else {
+			printf ("Cannot determine secure boot state.\n");
+		}
+
+		if (!timeout_known)
+			printf ("MokManager timeout: unknown\n");
+		else if (timeout < 0)
+			printf ("MokManager timeout: none\n");
+		else
+			printf ("MokManager timeout: %d seconds\n", timeout);
+
+		if (verbosity < 0)
+			printf ("SHIM_VERBOSE: unknown\n");
+		else
+			printf ("SHIM_VERBOSE: %s\n", verbosity ? "true" : "false");
+
+		printf ("Pending requests:");
+		for (unsigned int i = 0; i < PENDING_NUM; i++) {
+			if (!vars[POSTURE_PENDING + i].data)
+				continue;
+			printf (" %s", pending_var_names[i]);
+			n_pending++;
 		}
+		printf ("%s\n", n_pending ? "" : " none");
 	}
 
-	prefix = get_crypt_prefix (DEFAULT_CRYPT_METHOD);
-	if (!prefix)
-		return -1;
+	/* Decode and fingerprint the keys in parallel, in report order */
+	for (unsigned int i = 0; i < PENDING_KEY_LISTS; i++)
+		posture.key_vars[i] = POSTURE_PENDING + i;
+	for (unsigned int i = 0; i < DB_NUM; i++)
+		posture.key_vars[PENDING_KEY_LISTS + i] = POSTURE_DB + i;
 
-	memset (settings, 0, sizeof (settings));
-	next = stpncpy (settings, prefix, settings_len);
-	salt_size = get_salt_size (DEFAULT_CRYPT_METHOD);
-	if (salt_size > settings_len - (next - settings)) {
-		free(password);
-		errno = EOVERFLOW;
-		return -1;
-	}
-	generate_salt (next, salt_size);
-	next += salt_size;
-	*next = '\0';
+	run_parallel (POSTURE_KEY_VARS, render_var_keys, write_var_keys,
+		      &posture);
 
-	crypt_string = crypt (password, settings);
-	free (password);
-	if (!crypt_string) {
-		fprintf (stderr, "Failed to generate hash\n");
-		return -1;
-	}
+	if (output_format == OUTPUT_JSON)
+		printf ("\n]}\n");
 
-	printf ("%s\n", crypt_string);
+	free_var_entries (vars, POSTURE_VAR_NUM);
 
-	return 0;
+	return ret;
 }
 
+/* Parse "N" for --index or "A-B" / "A-" for --range */
 static int
-set_timeout (char *t)
+parse_key_range (const char *arg, int is_range)
 {
-	int timeout = strtol(t, NULL, 10);
+	unsigned long first, last;
+	char *endptr;
 
-	if (errno == ERANGE || timeout > 0x7fff)
-		timeout = 0x7fff;
-	if (timeout < 0)
-		timeout = -1;
+	if (has_key_range ())
+		return -1;
 
-	if (timeout != 10) {
-		uint32_t attributes = EFI_VARIABLE_NON_VOLATILE
-				      | EFI_VARIABLE_BOOTSERVICE_ACCESS
-				      | EFI_VARIABLE_RUNTIME_ACCESS;
-		if (efi_set_variable (efi_guid_shim, "MokTimeout",
-				      (uint8_t *)&timeout, sizeof (timeout),
-				      attributes, S_IRUSR | S_IWUSR) < 0) {
-			fprintf (stderr, "Failed to set MokTimeout\n");
+	if (!isdigit (arg[0]))
+		return -1;
+	first = strtoul (arg, &endptr, 10);
+	if (is_range) {
+		if (*endptr != '-')
 			return -1;
+		arg = endptr + 1;
+		if (*arg == '\0') {
+			last = UINT32_MAX;
+			endptr = (char *)arg;
+		} else {
+			if (!isdigit (arg[0]))
+				return -1;
+			last = strtoul (arg, &endptr, 10);
 		}
 	} else {
-		return test_and_delete_var ("MokTimeout");
+		last = first;
 	}
 
+	if (*endptr != '\0' || first == 0 || last < first ||
+	    first > UINT32_MAX || last > UINT32_MAX)
+		return -1;
+
+	key_index_first = first;
+	key_index_last = last;
+
 	return 0;
 }
 
+/* Collect the option argument and the ones following it up to the next
+ * option, e.g. "-i a.der b.der" */
 static int
-set_verbosity (uint8_t verbosity)
+get_file_args (int argc, char *argv[], char ***files, int *total)
 {
-	if (verbosity) {
-		uint32_t attributes = EFI_VARIABLE_NON_VOLATILE
-				      | EFI_VARIABLE_BOOTSERVICE_ACCESS
-				      | EFI_VARIABLE_RUNTIME_ACCESS;
-		if (efi_set_variable (efi_guid_shim, "SHIM_VERBOSE",
-				      (uint8_t *)&verbosity, sizeof (verbosity),
-				      attributes, S_IRUSR | S_IWUSR) < 0) {
-			fprintf (stderr, "Failed to set SHIM_VERBOSE\n");
-			return -1;
-		}
-	} else {
-		return test_and_delete_var ("SHIM_VERBOSE");
-	}
+	int f_ind, i;
 
-	return 0;
-}
+	*total = 0;
+	for (f_ind = optind - 1; f_ind < argc && *argv[f_ind] != '-'; f_ind++)
+		(*total)++;
 
-static inline int
-list_db (DBName db_name)
-{
-	switch (db_name) {
-		case MOK_LIST_RT:
-			return list_keys_in_var ("MokListRT", efi_guid_shim);
-		case MOK_LIST_X_RT:
-			return list_keys_in_var ("MokListXRT", efi_guid_shim);
-		case PK:
-			return list_keys_in_var ("PK", efi_guid_global);
-		case KEK:
-			return list_keys_in_var ("KEK", efi_guid_global);
-		case DB:
-			return list_keys_in_var ("db", efi_guid_security);
-		case DBX:
-			return list_keys_in_var ("dbx", efi_guid_security);
+	if (*total == 0)
+		return -1;
+
+	*files = malloc (*total * sizeof (char *));
+	if (*files == NULL) {
+		fprintf (stderr, "Could not allocate space: %m\n");
+		exit(1);
+	}
+	for (i = 0; i < *total; i++) {
+		f_ind = i + optind - 1;
+		(*files)[i] = malloc (strlen(argv[f_ind]) + 1);
+		strcpy ((*files)[i], argv[f_ind]);
 	}
 
-	return -1;
+	return 0;
 }
 
 int
 main (int argc, char *argv[])
 {
 	char **files = NULL;
-	char *key_file = NULL;
 	char *hash_file = NULL;
 	char *input_pw = NULL;
 	char *hash_str = NULL;
 	char *timeout = NULL;
+	char *metrics_file = NULL;
+	char *esl_var = NULL;
+	char *esl_file = NULL;
+	char *export_dir = NULL;
+	char *import_dir = NULL;
+	char *import_glob = NULL;
+	char *import_esl_file = NULL;
+	char *hashes_file = NULL;
+	int hash_binaries = 0;
+	char *scan_dir = NULL;
+	unsigned long expiring_days = 0;
 	const char *option;
-	int c, i, f_ind, total = 0;
-	unsigned int command = 0;
+	int c, i, total = 0;
+	uint64_t command = 0;
 	int use_root_pw = 0;
 	uint8_t verbosity = 0;
+	unsigned int bench_iterations = BENCH_READ_ITERATIONS;
+	int bench_write_test = 0;
+	ArchiveFormat archive_format = ARCHIVE_NONE;
 	DBName db_name = MOK_LIST_RT;
 	int ret = -1;
 
 	use_simple_hash = 0;
+	output_format = OUTPUT_TEXT;
+	key_index_first = 1;
+	key_index_last = UINT32_MAX;
 
 	if (!efi_variables_supported ()) {
 		fprintf (stderr, "EFI variables are not supported on this system\n");
@@ -2182,6 +7742,30 @@ main (int argc, char *argv[])
 			{"db",                 no_argument,       0, 0  },
 			{"dbx",                no_argument,       0, 0  },
 			{"timeout",            required_argument, 0, 0  },
+			{"bench-firmware",     optional_argument, 0, 0  },
+			{"bench-write",        no_argument,       0, 0  },
+			{"metrics",            required_argument, 0, 0  },
+			{"summary",            no_argument,       0, 0  },
+			{"posture",            no_argument,       0, 0  },
+			{"audit",              no_argument,       0, 0  },
+			{"scan-boot",          required_argument, 0, 0  },
+			{"verify-image",       required_argument, 0, 0  },
+			{"scan-modules",       required_argument, 0, 0  },
+			{"expiring",           required_argument, 0, 0  },
+			{"format",             required_argument, 0, 0  },
+			{"export-esl",         required_argument, 0, 0  },
+			{"export-dir",         required_argument, 0, 0  },
+			{"import-dir",         required_argument, 0, 0  },
+			{"glob",               required_argument, 0, 0  },
+			{"import-esl",         required_argument, 0, 0  },
+			{"import-hashes",      required_argument, 0, 0  },
+			{"delete-hashes",      required_argument, 0, 0  },
+			{"import-binary",      required_argument, 0, 0  },
+			{"blacklist-binary",   required_argument, 0, 0  },
+			{"output",             required_argument, 0, 0  },
+			{"short",              no_argument,       0, 0  },
+			{"index",              required_argument, 0, 0  },
+			{"range",              required_argument, 0, 0  },
 			{0, 0, 0, 0}
 		};
 
@@ -2213,7 +7797,7 @@ main (int argc, char *argv[])
 				command |= USE_DB;
 			} else if (strcmp (option, "import-hash") == 0) {
 				command |= IMPORT_HASH;
-				if (hash_str) {
+				if (hash_str || hashes_file) {
 					command |= HELP;
 					break;
 				}
@@ -2224,7 +7808,7 @@ main (int argc, char *argv[])
 				}
 			} else if (strcmp (option, "delete-hash") == 0) {
 				command |= DELETE_HASH;
-				if (hash_str) {
+				if (hash_str || hashes_file) {
 					command |= HELP;
 					break;
 				}
@@ -2233,6 +7817,39 @@ main (int argc, char *argv[])
 					fprintf (stderr, "Could not allocate space: %m\n");
 					exit(1);
 				}
+			} else if (strcmp (option, "import-hashes") == 0) {
+				command |= IMPORT_HASH;
+				if (hash_str || hashes_file) {
+					command |= HELP;
+					break;
+				}
+				hashes_file = strdup (optarg);
+				if (hashes_file == NULL) {
+					fprintf (stderr, "Could not allocate space: %m\n");
+					exit(1);
+				}
+			} else if (strcmp (option, "delete-hashes") == 0) {
+				command |= DELETE_HASH;
+				if (hash_str || hashes_file) {
+					command |= HELP;
+					break;
+				}
+				hashes_file = strdup (optarg);
+				if (hashes_file == NULL) {
+					fprintf (stderr, "Could not allocate space: %m\n");
+					exit(1);
+				}
+			} else if (strcmp (option, "import-binary") == 0 ||
+				   strcmp (option, "blacklist-binary") == 0) {
+				command |= IMPORT_HASH;
+				if (strcmp (option, "blacklist-binary") == 0)
+					command |= MOKX;
+				if (files ||
+				    get_file_args (argc, argv, &files, &total) < 0) {
+					command |= HELP;
+					break;
+				}
+				hash_binaries = 1;
 			} else if (strcmp (option, "set-verbosity") == 0) {
 				command |= VERBOSITY;
 				if (strcmp (optarg, "true") == 0)
@@ -2268,6 +7885,153 @@ main (int argc, char *argv[])
 			} else if (strcmp (option, "timeout") == 0) {
 				command |= TIMEOUT;
 				timeout = strdup (optarg);
+			} else if (strcmp (option, "bench-firmware") == 0) {
+				command |= BENCH_FIRMWARE;
+				if (optarg) {
+					char *endptr;
+
+					bench_iterations = strtoul (optarg, &endptr, 10);
+					if (*endptr != '\0' || bench_iterations == 0)
+						command |= HELP;
+				}
+			} else if (strcmp (option, "bench-write") == 0) {
+				bench_write_test = 1;
+			} else if (strcmp (option, "output") == 0) {
+				/* "text" is the default, and doesn't conflict
+				 * with --short in either order */
+				if (strcmp (optarg, "json") == 0) {
+					if (output_format != OUTPUT_TEXT)
+						command |= HELP;
+					output_format = OUTPUT_JSON;
+				} else if (strcmp (optarg, "text") != 0) {
+					command |= HELP;
+				}
+			} else if (strcmp (option, "index") == 0 ||
+				   strcmp (option, "range") == 0) {
+				if (parse_key_range (optarg, option[0] == 'r') < 0)
+					command |= HELP;
+			} else if (strcmp (option, "short") == 0) {
+				if (output_format != OUTPUT_TEXT)
+					command |= HELP;
+				output_format = OUTPUT_SHORT;
+			} else if (strcmp (option, "summary") == 0) {
+				command |= SUMMARY;
+			} else if (strcmp (option, "posture") == 0) {
+				command |= POSTURE;
+			} else if (strcmp (option, "audit") == 0) {
+				command |= AUDIT;
+			} else if (strcmp (option, "expiring") == 0) {
+				char *endptr;
+
+				command |= EXPIRING;
+				if (!isdigit (optarg[0])) {
+					command |= HELP;
+					break;
+				}
+				expiring_days = strtoul (optarg, &endptr, 10);
+				if (*endptr != '\0' || expiring_days > UINT32_MAX)
+					command |= HELP;
+			} else if (strcmp (option, "verify-image") == 0) {
+				command |= VERIFY_IMAGE;
+				if (files ||
+				    get_file_args (argc, argv, &files, &total) < 0)
+					command |= HELP;
+			} else if (strcmp (option, "scan-boot") == 0 ||
+				   strcmp (option, "scan-modules") == 0) {
+				if (strcmp (option, "scan-boot") == 0)
+					command |= SCAN_BOOT;
+				else
+					command |= SCAN_MODULES;
+				if (scan_dir) {
+					command |= HELP;
+					break;
+				}
+				scan_dir = strdup (optarg);
+				if (scan_dir == NULL) {
+					fprintf (stderr, "Could not allocate space: %m\n");
+					exit(1);
+				}
+			} else if (strcmp (option, "export-esl") == 0) {
+				if (esl_var) {
+					command |= HELP;
+					break;
+				}
+				command |= EXPORT_ESL;
+				esl_var = strdup (optarg);
+				if (esl_var == NULL) {
+					fprintf (stderr, "Could not allocate space: %m\n");
+					exit(1);
+				}
+				/* The output file is optional, "-" is stdout */
+				if (optind < argc && (*argv[optind] != '-' ||
+						      strcmp (argv[optind], "-") == 0)) {
+					esl_file = strdup (argv[optind++]);
+					if (esl_file == NULL) {
+						fprintf (stderr, "Could not allocate space: %m\n");
+						exit(1);
+					}
+				}
+			} else if (strcmp (option, "export-dir") == 0) {
+				if (export_dir) {
+					command |= HELP;
+					break;
+				}
+				command |= EXPORT_DIR;
+				export_dir = strdup (optarg);
+				if (export_dir == NULL) {
+					fprintf (stderr, "Could not allocate space: %m\n");
+					exit(1);
+				}
+			} else if (strcmp (option, "import-dir") == 0) {
+				if (import_dir) {
+					command |= HELP;
+					break;
+				}
+				command |= IMPORT;
+				import_dir = strdup (optarg);
+				if (import_dir == NULL) {
+					fprintf (stderr, "Could not allocate space: %m\n");
+					exit(1);
+				}
+			} else if (strcmp (option, "import-esl") == 0) {
+				if (import_esl_file) {
+					command |= HELP;
+					break;
+				}
+				command |= IMPORT;
+				import_esl_file = strdup (optarg);
+				if (import_esl_file == NULL) {
+					fprintf (stderr, "Could not allocate space: %m\n");
+					exit(1);
+				}
+			} else if (strcmp (option, "glob") == 0) {
+				if (import_glob) {
+					command |= HELP;
+					break;
+				}
+				import_glob = strdup (optarg);
+				if (import_glob == NULL) {
+					fprintf (stderr, "Could not allocate space: %m\n");
+					exit(1);
+				}
+			} else if (strcmp (option, "format") == 0) {
+				if (strcmp (optarg, "tar") == 0)
+					archive_format = ARCHIVE_TAR;
+				else if (strcmp (optarg, "cpio") == 0)
+					archive_format = ARCHIVE_CPIO;
+				else
+					command |= HELP;
+			} else if (strcmp (option, "metrics") == 0) {
+				if (metrics_file) {
+					command |= HELP;
+					break;
+				}
+				command |= METRICS;
+				metrics_file = strdup (optarg);
+				if (metrics_file == NULL) {
+					fprintf (stderr, "Could not allocate space: %m\n");
+					exit(1);
+				}
 			}
 
 			break;
@@ -2282,38 +8046,16 @@ main (int argc, char *argv[])
 			break;
 		case 'd':
 		case 'i':
+		case 't':
 			if (c == 'd')
 				command |= DELETE;
+			else if (c == 't')
+				command |= TEST_KEY;
 			else
 				command |= IMPORT;
 
-			if (files) {
-				command |= HELP;
-				break;
-			}
-
-			total = 0;
-			for (f_ind = optind - 1;
-			     f_ind < argc && *argv[f_ind] != '-';
-			     f_ind++) {
-				total++;
-			}
-
-			if (total == 0) {
+			if (files || get_file_args (argc, argv, &files, &total) < 0)
 				command |= HELP;
-				break;
-			}
-
-			files = malloc (total * sizeof (char *));
-			if (files == NULL) {
-				fprintf (stderr, "Could not allocate space: %m\n");
-				exit(1);
-			}
-			for (i = 0; i < total; i++) {
-				f_ind = i + optind - 1;
-				files[i] = malloc (strlen(argv[f_ind]) + 1);
-				strcpy (files[i], argv[f_ind]);
-			}
 
 			break;
 		case 'f':
@@ -2352,19 +8094,6 @@ main (int argc, char *argv[])
 		case 'P':
 			use_root_pw = 1;
 			break;
-		case 't':
-			if (key_file) {
-				command |= HELP;
-				break;
-			}
-			key_file = strdup (optarg);
-			if (key_file == NULL) {
-				fprintf (stderr, "Could not allocate space: %m\n");
-				exit(1);
-			}
-
-			command |= TEST_KEY;
-			break;
 		case 'x':
 			command |= EXPORT;
 			break;
@@ -2398,9 +8127,45 @@ main (int argc, char *argv[])
 	if (hash_file && use_root_pw)
 		command |= HELP;
 
+	if (bench_write_test && !(command & BENCH_FIRMWARE))
+		command |= HELP;
+
+	if (archive_format != ARCHIVE_NONE && !(command & EXPORT))
+		command |= HELP;
+
+	if ((import_dir && files) || (import_glob && !import_dir))
+		command |= HELP;
+
+	if (import_esl_file && (files || import_dir))
+		command |= HELP;
+
+	if (hash_binaries && (hash_str || hashes_file))
+		command |= HELP;
+
+	if (import_dir && !(command & HELP)) {
+		uint32_t dir_total = 0;
+
+		if (collect_dir_files (import_dir, import_glob, &files,
+				       &dir_total) < 0) {
+			ret = -1;
+			goto out;
+		}
+		total = dir_total;
+		if (total == 0) {
+			fprintf (stderr, "No key files found in %s\n", import_dir);
+			ret = -1;
+			goto out;
+		}
+	}
+
 	if (db_name != MOK_LIST_RT && !(command & ~MOKX))
 		command |= LIST_ENROLLED;
 
+	/* Only the list commands pick the keys by their position */
+	if (has_key_range () && (command & ~MOKX) != LIST_ENROLLED &&
+	    (command & ~MOKX) != LIST_NEW && (command & ~MOKX) != LIST_DELETE)
+		command |= HELP;
+
 	if (!(command & HELP)) {
 		/* Check whether the machine supports Secure Boot or not */
 		int rc;
@@ -2431,8 +8196,12 @@ main (int argc, char *argv[])
 			break;
 		case IMPORT:
 		case IMPORT | SIMPLE_HASH:
-			ret = issue_mok_request (files, total, ENROLL_MOK,
-						 hash_file, use_root_pw);
+			if (import_esl_file)
+				ret = import_esl (import_esl_file, ENROLL_MOK,
+						  hash_file, use_root_pw);
+			else
+				ret = issue_mok_request (files, total, ENROLL_MOK,
+							 hash_file, use_root_pw);
 			break;
 		case DELETE:
 		case DELETE | SIMPLE_HASH:
@@ -2441,13 +8210,24 @@ main (int argc, char *argv[])
 			break;
 		case IMPORT_HASH:
 		case IMPORT_HASH | SIMPLE_HASH:
-			ret = issue_hash_request (hash_str, ENROLL_MOK,
-						  hash_file, use_root_pw);
+			if (hashes_file)
+				ret = issue_hashes_request (hashes_file, ENROLL_MOK,
+							    hash_file, use_root_pw);
+			else if (hash_binaries)
+				ret = issue_binary_request (files, total, ENROLL_MOK,
+							    hash_file, use_root_pw);
+			else
+				ret = issue_hash_request (hash_str, ENROLL_MOK,
+							  hash_file, use_root_pw);
 			break;
 		case DELETE_HASH:
 		case DELETE_HASH | SIMPLE_HASH:
-			ret = issue_hash_request (hash_str, DELETE_MOK,
-						  hash_file, use_root_pw);
+			if (hashes_file)
+				ret = issue_hashes_request (hashes_file, DELETE_MOK,
+							    hash_file, use_root_pw);
+			else
+				ret = issue_hash_request (hash_str, DELETE_MOK,
+							  hash_file, use_root_pw);
 			break;
 		case REVOKE_IMPORT:
 			ret = revoke_request (ENROLL_MOK);
@@ -2457,7 +8237,10 @@ main (int argc, char *argv[])
 			break;
 		case EXPORT:
 		case EXPORT | MOKX:
-			ret = export_db_keys (db_name);
+			if (archive_format != ARCHIVE_NONE)
+				ret = export_db_archive (db_name, archive_format);
+			else
+				ret = export_db_keys (db_name);
 			break;
 		case PASSWORD:
 		case PASSWORD | SIMPLE_HASH:
@@ -2477,7 +8260,7 @@ main (int argc, char *argv[])
 			ret = sb_state ();
 			break;
 		case TEST_KEY:
-			ret = test_key (ENROLL_MOK, key_file);
+			ret = test_key (ENROLL_MOK, files, total);
 			break;
 		case RESET:
 		case RESET | SIMPLE_HASH:
@@ -2500,8 +8283,12 @@ main (int argc, char *argv[])
 			break;
 		case IMPORT | MOKX:
 		case IMPORT | SIMPLE_HASH | MOKX:
-			ret = issue_mok_request (files, total, ENROLL_BLACKLIST,
-						 hash_file, use_root_pw);
+			if (import_esl_file)
+				ret = import_esl (import_esl_file, ENROLL_BLACKLIST,
+						  hash_file, use_root_pw);
+			else
+				ret = issue_mok_request (files, total, ENROLL_BLACKLIST,
+							 hash_file, use_root_pw);
 			break;
 		case DELETE | MOKX:
 		case DELETE | SIMPLE_HASH | MOKX:
@@ -2510,13 +8297,24 @@ main (int argc, char *argv[])
 			break;
 		case IMPORT_HASH | MOKX:
 		case IMPORT_HASH | SIMPLE_HASH | MOKX:
-			ret = issue_hash_request (hash_str, ENROLL_BLACKLIST,
-						  hash_file, use_root_pw);
+			if (hashes_file)
+				ret = issue_hashes_request (hashes_file, ENROLL_BLACKLIST,
+							    hash_file, use_root_pw);
+			else if (hash_binaries)
+				ret = issue_binary_request (files, total, ENROLL_BLACKLIST,
+							    hash_file, use_root_pw);
+			else
+				ret = issue_hash_request (hash_str, ENROLL_BLACKLIST,
+							  hash_file, use_root_pw);
 			break;
 		case DELETE_HASH | MOKX:
 		case DELETE_HASH | SIMPLE_HASH | MOKX:
-			ret = issue_hash_request (hash_str, DELETE_BLACKLIST,
-						  hash_file, use_root_pw);
+			if (hashes_file)
+				ret = issue_hashes_request (hashes_file, DELETE_BLACKLIST,
+							    hash_file, use_root_pw);
+			else
+				ret = issue_hash_request (hash_str, DELETE_BLACKLIST,
+							  hash_file, use_root_pw);
 			break;
 		case REVOKE_IMPORT | MOKX:
 			ret = revoke_request (ENROLL_BLACKLIST);
@@ -2529,7 +8327,7 @@ main (int argc, char *argv[])
 			ret = reset_moks (ENROLL_BLACKLIST, hash_file, use_root_pw);
 			break;
 		case TEST_KEY | MOKX:
-			ret = test_key (ENROLL_BLACKLIST, key_file);
+			ret = test_key (ENROLL_BLACKLIST, files, total);
 			break;
 		case VERBOSITY:
 			ret = set_verbosity (verbosity);
@@ -2537,6 +8335,40 @@ main (int argc, char *argv[])
 		case TIMEOUT:
 			ret = set_timeout (timeout);
 			break;
+		case BENCH_FIRMWARE:
+			ret = bench_firmware (bench_iterations, bench_write_test);
+			break;
+		case METRICS:
+			ret = write_metrics (metrics_file);
+			break;
+		case SUMMARY:
+			ret = summarize_dbs ();
+			break;
+		case POSTURE:
+			ret = report_posture ();
+			break;
+		case AUDIT:
+			ret = audit_keys ();
+			break;
+		case SCAN_BOOT:
+			ret = scan_boot (scan_dir);
+			break;
+		case VERIFY_IMAGE:
+			ret = verify_images (files, total);
+			break;
+		case SCAN_MODULES:
+			ret = scan_modules (scan_dir);
+			break;
+		case EXPIRING:
+			ret = expiring_keys (expiring_days);
+			break;
+		case EXPORT_ESL:
+			ret = export_esl (esl_var, esl_file);
+			break;
+		case EXPORT_DIR:
+		case EXPORT_DIR | MOKX:
+			ret = export_db_dir (db_name, export_dir);
+			break;
 		default:
 			print_help ();
 			break;
@@ -2552,8 +8384,32 @@ out:
 	if (timeout)
 		free (timeout);
 
-	if (key_file)
-		free (key_file);
+	if (metrics_file)
+		free (metrics_file);
+
+	if (esl_var)
+		free (esl_var);
+
+	if (esl_file)
+		free (esl_file);
+
+	if (export_dir)
+		free (export_dir);
+
+	if (import_dir)
+		free (import_dir);
+
+	if (import_glob)
+		free (import_glob);
+
+	if (import_esl_file)
+		free (import_esl_file);
+
+	if (hashes_file)
+		free (hashes_file);
+
+	if (scan_dir)
+		free (scan_dir);
 
 	if (hash_file)
 		free (hash_file);
@@ -71,4 +71,59 @@ typedef struct {
 	///
 } __attribute__ ((packed)) EFI_SIGNATURE_LIST;
 
+typedef struct {
+	uint16_t            Year;
+	uint8_t             Month;
+	uint8_t             Day;
+	uint8_t             Hour;
+	uint8_t             Minute;
+	uint8_t             Second;
+	uint8_t             Pad1;
+	uint32_t            Nanosecond;
+	int16_t             TimeZone;
+	uint8_t             Daylight;
+	uint8_t             Pad2;
+} __attribute__ ((packed)) EFI_TIME;
+
+#define WIN_CERT_REVISION_2_0   0x0200
+#define WIN_CERT_TYPE_EFI_GUID  0x0EF1
+
+typedef struct {
+	///
+	/// The length of the entire certificate, including the length of the header, in bytes.
+	///
+	uint32_t            dwLength;
+	///
+	/// The revision level of the WIN_CERTIFICATE structure.
+	///
+	uint16_t            wRevision;
+	///
+	/// The certificate type, WIN_CERT_TYPE_EFI_GUID for authenticated variables.
+	///
+	uint16_t            wCertificateType;
+} __attribute__ ((packed)) WIN_CERTIFICATE;
+
+typedef struct {
+	WIN_CERTIFICATE     Hdr;
+	///
+	/// The type of the certificate data, EFI_CERT_TYPE_PKCS7_GUID for authenticated variables.
+	///
+	efi_guid_t          CertType;
+	///
+	/// The certificate data, CertData[Hdr.dwLength - sizeof(WIN_CERTIFICATE_UEFI_GUID) + 1].
+	///
+	uint8_t             CertData[1];
+} __attribute__ ((packed)) WIN_CERTIFICATE_UEFI_GUID;
+
+typedef struct {
+	///
+	/// The time associated with the authentication descriptor.
+	///
+	EFI_TIME                  TimeStamp;
+	///
+	/// Only a CertType of EFI_CERT_TYPE_PKCS7_GUID is accepted.
+	///
+	WIN_CERTIFICATE_UEFI_GUID AuthInfo;
+} __attribute__ ((packed)) EFI_VARIABLE_AUTHENTICATION_2;
+
 #endif /* SIGNATURE_H */